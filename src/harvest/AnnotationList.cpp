@@ -5,7 +5,7 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "AnnotationList.h"
-#include <fstream>
+#include "InputStream.h"
 #include "parse.h"
 #include <algorithm>
 
@@ -74,7 +74,7 @@ void AnnotationList::initFromCapnp(const capnp::Harvest::Reader & harvestReader,
 
 void AnnotationList::initFromGenbank(const char * file, ReferenceList & referenceList, bool useSeq)
 {
-	ifstream in(file);
+	InputStream in(file);
 	char * line = new char[1 << 20];
 	Annotation * annotation = 0;
 	int offset;
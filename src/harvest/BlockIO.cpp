@@ -0,0 +1,733 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "harvest/BlockIO.h"
+
+#include <fcntl.h>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+using namespace::std;
+
+static const char * blockFooterMagic = "GGRI";
+
+static void putUint32(char * dest, uint32_t value)
+{
+	for ( int i = 0; i < 4; i++ )
+	{
+		dest[i] = (value >> (8 * i)) & 0xff;
+	}
+}
+
+static void putUint64(char * dest, uint64_t value)
+{
+	for ( int i = 0; i < 8; i++ )
+	{
+		dest[i] = (value >> (8 * i)) & 0xff;
+	}
+}
+
+static uint32_t getUint32(const char * src)
+{
+	uint32_t value = 0;
+	
+	for ( int i = 0; i < 4; i++ )
+	{
+		value |= (uint32_t)(unsigned char)src[i] << (8 * i);
+	}
+	
+	return value;
+}
+
+static uint64_t getUint64(const char * src)
+{
+	uint64_t value = 0;
+	
+	for ( int i = 0; i < 8; i++ )
+	{
+		value |= (uint64_t)(unsigned char)src[i] << (8 * i);
+	}
+	
+	return value;
+}
+
+static bool readAll(int fd, char * data, size_t size, uint64_t offset)
+{
+	while ( size > 0 )
+	{
+		ssize_t bytesRead = pread(fd, data, size, offset);
+		
+		if ( bytesRead <= 0 )
+		{
+			return false;
+		}
+		
+		data += bytesRead;
+		size -= bytesRead;
+		offset += bytesRead;
+	}
+	
+	return true;
+}
+
+static bool writeAll(int fd, const char * data, size_t size)
+{
+	while ( size > 0 )
+	{
+		ssize_t bytesWritten = ::write(fd, data, size);
+		
+		if ( bytesWritten <= 0 )
+		{
+			return false;
+		}
+		
+		data += bytesWritten;
+		size -= bytesWritten;
+	}
+	
+	return true;
+}
+
+const char * getCodecName(BlockCodec codec)
+{
+	switch ( codec )
+	{
+		case CODEC_none: return "none";
+		case CODEC_zlib: return "zlib";
+		case CODEC_zstd: return "zstd";
+		case CODEC_lz4: return "lz4";
+	}
+	
+	return "unknown";
+}
+
+bool getCodecLevelRange(BlockCodec codec, int & min, int & max)
+{
+	switch ( codec )
+	{
+		case CODEC_zlib:
+			min = Z_NO_COMPRESSION;
+			max = Z_BEST_COMPRESSION;
+			return true;
+
+#ifdef HAVE_ZSTD
+		case CODEC_zstd:
+			min = ZSTD_minCLevel();
+			max = ZSTD_maxCLevel();
+			return true;
+#endif
+
+#ifdef HAVE_LZ4
+		case CODEC_lz4:
+			// the level is the acceleration factor
+			
+			min = 1;
+#ifdef LZ4_ACCELERATION_MAX
+			max = LZ4_ACCELERATION_MAX;
+#else
+			max = 65537;
+#endif
+			return true;
+#endif
+
+		default:
+			return false;
+	}
+}
+
+bool isCodecAvailable(BlockCodec codec)
+{
+	switch ( codec )
+	{
+		case CODEC_none:
+		case CODEC_zlib:
+			return true;
+
+#ifdef HAVE_ZSTD
+		case CODEC_zstd:
+			return true;
+#endif
+
+#ifdef HAVE_LZ4
+		case CODEC_lz4:
+			return true;
+#endif
+
+		default:
+			return false;
+	}
+}
+
+bool compressBlock(BlockCodec codec, int level, const char * data, size_t size, string & compressed)
+{
+	switch ( codec )
+	{
+		case CODEC_none:
+			compressed.assign(data, size);
+			return true;
+		
+		case CODEC_zlib:
+		{
+			uLongf sizeCompressed = compressBound(size);
+			compressed.resize(sizeCompressed);
+			
+			if ( compress2((Bytef *)&compressed[0], &sizeCompressed, (const Bytef *)data, size, level == blockLevelDefault ? Z_DEFAULT_COMPRESSION : level) != Z_OK )
+			{
+				return false;
+			}
+			
+			compressed.resize(sizeCompressed);
+			return true;
+		}
+
+#ifdef HAVE_ZSTD
+		case CODEC_zstd:
+		{
+			compressed.resize(ZSTD_compressBound(size));
+			
+			size_t sizeCompressed = ZSTD_compress(&compressed[0], compressed.length(), data, size, level == blockLevelDefault ? ZSTD_CLEVEL_DEFAULT : level);
+			
+			if ( ZSTD_isError(sizeCompressed) )
+			{
+				return false;
+			}
+			
+			compressed.resize(sizeCompressed);
+			return true;
+		}
+#endif
+
+#ifdef HAVE_LZ4
+		case CODEC_lz4:
+		{
+			// the level is used as the acceleration factor
+			
+			compressed.resize(LZ4_compressBound(size));
+			
+			int sizeCompressed = LZ4_compress_fast(data, &compressed[0], size, compressed.length(), level == blockLevelDefault ? 1 : level);
+			
+			if ( sizeCompressed <= 0 )
+			{
+				return false;
+			}
+			
+			compressed.resize(sizeCompressed);
+			return true;
+		}
+#endif
+
+		default:
+			break;
+	}
+	
+	return false;
+}
+
+bool decompressBlock(BlockCodec codec, const char * compressed, size_t sizeCompressed, char * data, size_t size)
+{
+	switch ( codec )
+	{
+		case CODEC_none:
+			if ( sizeCompressed != size )
+			{
+				return false;
+			}
+			
+			memcpy(data, compressed, size);
+			return true;
+		
+		case CODEC_zlib:
+		{
+			uLongf sizeData = size;
+			
+			if ( uncompress((Bytef *)data, &sizeData, (const Bytef *)compressed, sizeCompressed) != Z_OK )
+			{
+				return false;
+			}
+			
+			return sizeData == size;
+		}
+
+#ifdef HAVE_ZSTD
+		case CODEC_zstd:
+		{
+			size_t sizeData = ZSTD_decompress(data, size, compressed, sizeCompressed);
+			
+			return ! ZSTD_isError(sizeData) && sizeData == size;
+		}
+#endif
+
+#ifdef HAVE_LZ4
+		case CODEC_lz4:
+			return LZ4_decompress_safe(compressed, data, sizeCompressed, size) == size;
+#endif
+
+		default:
+			break;
+	}
+	
+	return false;
+}
+
+BlockWriter::BlockWriter(int fdNew, BlockCodec codecNew, int levelNew, int flagsNew, ThreadPool * poolNew, int blockSizeNew)
+{
+	fd = fdNew;
+	codec = codecNew;
+	level = levelNew;
+	flags = flagsNew;
+	pool = poolNew;
+	blockSize = blockSizeNew;
+	closed = false;
+	
+	char header[blockHeaderLength];
+	
+	memset(header, 0, blockHeaderLength);
+	memcpy(header, capnpHeader, capnpHeaderLength);
+	header[capnpHeaderLength + 1] = blockVersion;
+	header[capnpHeaderLength + 2] = codec;
+	header[capnpHeaderLength + 3] = flags;
+	
+	if ( ! writeAll(fd, header, blockHeaderLength) )
+	{
+		cerr << "ERROR: could not write block header.\n";
+		exit(1);
+	}
+	
+	offset = blockHeaderLength;
+	buffer.reserve(blockSize);
+}
+
+BlockWriter::~BlockWriter()
+{
+	close();
+}
+
+void BlockWriter::beginSection(uint32_t type, uint64_t keyStart, uint64_t keyEnd)
+{
+	flush();
+	
+	BlockSection section;
+	
+	section.type = type;
+	section.blockStart = getBlockCount();
+	section.blockCount = 0;
+	section.keyStart = keyStart;
+	section.keyEnd = keyEnd;
+	
+	sections.push_back(section);
+}
+
+void BlockWriter::close()
+{
+	if ( closed )
+	{
+		return;
+	}
+	
+	flush();
+	drain(true);
+	
+	// index and footer
+	
+	string index(blocks.size() * blockIndexEntryLength + sections.size() * blockSectionEntryLength + blockFooterLength, 0);
+	
+	for ( int i = 0; i < blocks.size(); i++ )
+	{
+		char * entry = &index[i * blockIndexEntryLength];
+		
+		putUint64(entry, blocks[i].offset);
+		putUint32(entry + 8, blocks[i].sizeCompressed);
+		putUint32(entry + 12, blocks[i].size);
+	}
+	
+	for ( int i = 0; i < sections.size(); i++ )
+	{
+		char * entry = &index[blocks.size() * blockIndexEntryLength + i * blockSectionEntryLength];
+		
+		putUint32(entry, sections[i].type);
+		putUint32(entry + 4, sections[i].blockStart);
+		putUint32(entry + 8, sections[i].blockCount);
+		putUint64(entry + 16, sections[i].keyStart);
+		putUint64(entry + 24, sections[i].keyEnd);
+	}
+	
+	char * footer = &index[index.length() - blockFooterLength];
+	
+	putUint64(footer, offset);
+	putUint32(footer + 8, blocks.size());
+	memcpy(footer + 12, blockFooterMagic, 4);
+	
+	if ( ! writeAll(fd, index.c_str(), index.length()) )
+	{
+		cerr << "ERROR: could not write block index.\n";
+		exit(1);
+	}
+	
+	closed = true;
+}
+
+void BlockWriter::drain(bool all)
+{
+	// Blocks are written in order as they finish; the queue is bounded so
+	// compressed blocks do not pile up in memory while a slow disk catches up.
+	
+	int limit = all ? 0 : (pool ? 2 * pool->getThreadCount() : 0);
+	
+	while ( pending.size() > limit )
+	{
+		writeBlock(pending.front().get(), pendingSizes.front());
+		pending.pop_front();
+		pendingSizes.pop_front();
+	}
+}
+
+void BlockWriter::endSection()
+{
+	flush();
+	
+	BlockSection & section = sections.at(sections.size() - 1);
+	
+	section.blockCount = getBlockCount() - section.blockStart;
+}
+
+void BlockWriter::flush()
+{
+	if ( buffer.length() == 0 )
+	{
+		return;
+	}
+	
+	if ( codec == CODEC_none )
+	{
+		// nothing to compress, but pending blocks must be written first to
+		// keep the order
+		
+		drain(true);
+		writeBlock(buffer, buffer.length());
+		buffer.clear();
+	}
+	else if ( pool )
+	{
+		BlockCodec codecTask = codec;
+		int levelTask = level;
+		shared_ptr<string> data(new string());
+		
+		data->swap(buffer);
+		
+		pending.push_back(pool->submit([codecTask, levelTask, data]()
+		{
+			string compressed;
+			
+			if ( ! compressBlock(codecTask, levelTask, data->c_str(), data->length(), compressed) )
+			{
+				cerr << "ERROR: could not compress block.\n";
+				exit(1);
+			}
+			
+			return compressed;
+		}));
+		
+		pendingSizes.push_back(data->length());
+		drain(false);
+	}
+	else
+	{
+		string compressed;
+		
+		if ( ! compressBlock(codec, level, buffer.c_str(), buffer.length(), compressed) )
+		{
+			cerr << "ERROR: could not compress block.\n";
+			exit(1);
+		}
+		
+		writeBlock(compressed, buffer.length());
+		buffer.clear();
+	}
+	
+	buffer.reserve(blockSize);
+}
+
+void BlockWriter::write(const void * data, size_t size)
+{
+	const char * dataChar = (const char *)data;
+	
+	while ( size > 0 )
+	{
+		size_t sizeCopy = blockSize - buffer.length();
+		
+		if ( sizeCopy > size )
+		{
+			sizeCopy = size;
+		}
+		
+		buffer.append(dataChar, sizeCopy);
+		dataChar += sizeCopy;
+		size -= sizeCopy;
+		
+		if ( buffer.length() == blockSize )
+		{
+			flush();
+		}
+	}
+}
+
+void BlockWriter::writeBlock(const string & compressed, uint32_t size)
+{
+	if ( ! writeAll(fd, compressed.c_str(), compressed.length()) )
+	{
+		cerr << "ERROR: could not write block.\n";
+		exit(1);
+	}
+	
+	blocks.resize(blocks.size() + 1);
+	
+	Block & block = blocks[blocks.size() - 1];
+	
+	block.offset = offset;
+	block.sizeCompressed = compressed.length();
+	block.size = size;
+	
+	offset += compressed.length();
+}
+
+BlockReader::BlockReader()
+{
+	fd = -1;
+	codec = CODEC_none;
+	flags = 0;
+}
+
+BlockReader::~BlockReader()
+{
+	if ( fd >= 0 )
+	{
+		::close(fd);
+	}
+}
+
+uint64_t BlockReader::getSize(int blockStart, int blockCount) const
+{
+	uint64_t size = 0;
+	
+	for ( int i = blockStart; i < blockStart + blockCount; i++ )
+	{
+		size += blocks.at(i).size;
+	}
+	
+	return size;
+}
+
+bool BlockReader::isContiguous(int blockStart, int blockCount) const
+{
+	// true if the blocks are stored uncompressed, back to back
+	
+	if ( codec != CODEC_none || blockStart < 0 || blockStart + blockCount > blocks.size() )
+	{
+		return false;
+	}
+	
+	for ( int i = blockStart; i < blockStart + blockCount; i++ )
+	{
+		const Block & block = blocks[i];
+		
+		if
+		(
+			block.sizeCompressed != block.size ||
+			block.offset - blocks[blockStart].offset != block.position - blocks[blockStart].position
+		)
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool BlockReader::open(const char * file)
+{
+	fd = ::open(file, O_RDONLY);
+	
+	if ( fd < 0 )
+	{
+		return false;
+	}
+	
+	struct stat st;
+	
+	if ( fstat(fd, &st) != 0 || st.st_size < blockHeaderLength + blockFooterLength )
+	{
+		return false;
+	}
+	
+	char header[blockHeaderLength];
+	char footer[blockFooterLength];
+	
+	if
+	(
+		! readAll(fd, header, blockHeaderLength, 0) ||
+		! readAll(fd, footer, blockFooterLength, st.st_size - blockFooterLength)
+	)
+	{
+		return false;
+	}
+	
+	if
+	(
+		strncmp(header, capnpHeader, capnpHeaderLength) != 0 ||
+		header[capnpHeaderLength] != 0 ||
+		header[capnpHeaderLength + 1] > blockVersion ||
+		strncmp(footer + 12, blockFooterMagic, 4) != 0
+	)
+	{
+		return false;
+	}
+	
+	int sectionEntryLength = header[capnpHeaderLength + 1] < 2 ? blockSectionEntryLengthV1 : blockSectionEntryLength;
+	
+	codec = (BlockCodec)header[capnpHeaderLength + 2];
+	flags = header[capnpHeaderLength + 3];
+	
+	uint64_t indexOffset = getUint64(footer);
+	uint32_t blockCount = getUint32(footer + 8);
+	
+	uint64_t indexLength = st.st_size - blockFooterLength - indexOffset;
+	
+	if
+	(
+		indexOffset > st.st_size - blockFooterLength ||
+		indexLength < (uint64_t)blockCount * blockIndexEntryLength ||
+		(indexLength - (uint64_t)blockCount * blockIndexEntryLength) % sectionEntryLength != 0
+	)
+	{
+		return false;
+	}
+	
+	string index(indexLength, 0);
+	
+	if ( ! readAll(fd, &index[0], index.length(), indexOffset) )
+	{
+		return false;
+	}
+	
+	blocks.resize(blockCount);
+	uint64_t position = 0;
+	
+	for ( int i = 0; i < blockCount; i++ )
+	{
+		const char * entry = &index[i * blockIndexEntryLength];
+		
+		blocks[i].offset = getUint64(entry);
+		blocks[i].sizeCompressed = getUint32(entry + 8);
+		blocks[i].size = getUint32(entry + 12);
+		blocks[i].position = position;
+		
+		position += blocks[i].size;
+	}
+	
+	sections.resize((indexLength - blockCount * blockIndexEntryLength) / sectionEntryLength);
+	
+	for ( int i = 0; i < sections.size(); i++ )
+	{
+		const char * entry = &index[blockCount * blockIndexEntryLength + i * sectionEntryLength];
+		
+		sections[i].type = getUint32(entry);
+		sections[i].blockStart = getUint32(entry + 4);
+		sections[i].blockCount = getUint32(entry + 8);
+		
+		if ( sectionEntryLength == blockSectionEntryLength )
+		{
+			sections[i].keyStart = getUint64(entry + 16);
+			sections[i].keyEnd = getUint64(entry + 24);
+		}
+		else
+		{
+			sections[i].keyStart = 0;
+			sections[i].keyEnd = UINT64_MAX;
+		}
+		
+		if ( sections[i].blockStart + sections[i].blockCount > blockCount )
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool BlockReader::read(int blockStart, int blockCount, char * data, ThreadPool * pool) const
+{
+	if ( blockStart < 0 || blockStart + blockCount > blocks.size() )
+	{
+		return false;
+	}
+	
+	if ( blockCount == 0 )
+	{
+		return true;
+	}
+	
+	// blocks are inflated straight into their place in the output
+	
+	uint64_t positionStart = blocks[blockStart].position;
+	
+	if ( pool == 0 )
+	{
+		for ( int i = blockStart; i < blockStart + blockCount; i++ )
+		{
+			if ( ! readBlock(i, data + blocks[i].position - positionStart) )
+			{
+				return false;
+			}
+		}
+		
+		return true;
+	}
+	
+	vector<future<bool> > results;
+	
+	for ( int i = blockStart; i < blockStart + blockCount; i++ )
+	{
+		char * dest = data + blocks[i].position - positionStart;
+		
+		results.push_back(pool->submit([this, i, dest]() { return readBlock(i, dest); }));
+	}
+	
+	bool success = true;
+	
+	for ( int i = 0; i < results.size(); i++ )
+	{
+		if ( ! results[i].get() )
+		{
+			success = false;
+		}
+	}
+	
+	return success;
+}
+
+bool BlockReader::readBlock(int index, char * data) const
+{
+	const Block & block = blocks[index];
+	string compressed(block.sizeCompressed, 0);
+	
+	if ( ! readAll(fd, &compressed[0], block.sizeCompressed, block.offset) )
+	{
+		return false;
+	}
+	
+	return decompressBlock(codec, compressed.c_str(), block.sizeCompressed, data, block.size);
+}
@@ -0,0 +1,173 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef BlockIO_h
+#define BlockIO_h
+
+#include <deque>
+#include <future>
+#include <string>
+#include <vector>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "harvest/ThreadPool.h"
+
+// Block container for Gingr files. The serialized message is split into
+// independently compressed blocks (similar to BGZF) so they can be deflated
+// and inflated in parallel. An index of block offsets follows the blocks:
+//
+//   header  "Cap'n Proto", 0, version, codec, flags, 0     (16 bytes)
+//   blocks  compressed data
+//   index   offset (8), compressed size (4), size (4)       (per block)
+//           type (4), first block (4), block count (4), 0 (4),
+//           first key (8), last key (8)                     (per section)
+//   footer  index offset (8), block count (4), "GGRI"       (16 bytes)
+//
+// Sections start and end on block boundaries, so a reader can decompress
+// just the sections it needs. A type can be split into several sections
+// holding consecutive ranges of records; the keys give the range of each so
+// it can be skipped without decompressing it. The number of sections follows
+// from the size of the index; files without sections are a single message.
+// Version 1 section entries have no keys (16 bytes).
+// With CODEC_none the blocks are stored as-is, so the message is contiguous
+// and word-aligned in the file (the header is 16 bytes) and can be read in
+// place from a memory map.
+//
+// Legacy files have a single zlib stream directly after "Cap'n Proto", so the
+// zero byte that follows the magic distinguishes the two.
+//
+// All integers are little-endian.
+
+static const char * capnpHeader = "Cap'n Proto";
+static const int capnpHeaderLength = strlen(capnpHeader);
+
+static const int blockHeaderLength = 16;
+static const int blockFooterLength = 16;
+static const int blockIndexEntryLength = 16;
+static const int blockSectionEntryLength = 32;
+static const int blockSectionEntryLengthV1 = 16;
+static const int blockVersion = 2;
+static const int blockSizeDefault = 1 << 20;
+
+enum BlockCodec
+{
+	CODEC_none = 0,
+	CODEC_zlib = 1,
+	CODEC_zstd = 2, // requires HAVE_ZSTD
+	CODEC_lz4 = 3, // requires HAVE_LZ4
+};
+
+enum BlockFlag
+{
+	BLOCK_FLAG_packed = 1, // messages are written with capnp::writePackedMessage
+};
+
+static const int blockLevelDefault = INT_MIN; // use the codec's default level (no codec accepts it)
+
+struct BlockSection
+{
+	uint32_t type;
+	uint32_t blockStart;
+	uint32_t blockCount;
+	uint64_t keyStart;
+	uint64_t keyEnd;
+};
+
+const char * getCodecName(BlockCodec codec);
+bool getCodecLevelRange(BlockCodec codec, int & min, int & max); // false if the codec has no levels
+bool isCodecAvailable(BlockCodec codec);
+bool compressBlock(BlockCodec codec, int level, const char * data, size_t size, std::string & compressed);
+bool decompressBlock(BlockCodec codec, const char * compressed, size_t sizeCompressed, char * data, size_t size);
+
+class BlockWriter
+{
+public:
+
+	BlockWriter(int fdNew, BlockCodec codecNew, int levelNew, int flagsNew = 0, ThreadPool * poolNew = 0, int blockSizeNew = blockSizeDefault);
+	~BlockWriter();
+	
+	void beginSection(uint32_t type, uint64_t keyStart = 0, uint64_t keyEnd = UINT64_MAX);
+	void close();
+	void endSection();
+	void flush();
+	int getBlockCount() const;
+	void write(const void * data, size_t size);
+
+private:
+
+	struct Block
+	{
+		uint64_t offset;
+		uint32_t sizeCompressed;
+		uint32_t size;
+	};
+	
+	void drain(bool all);
+	void writeBlock(const std::string & compressed, uint32_t size);
+	
+	int fd;
+	BlockCodec codec;
+	int level;
+	int flags;
+	ThreadPool * pool;
+	int blockSize;
+	std::string buffer;
+	std::deque<std::future<std::string> > pending;
+	std::deque<uint32_t> pendingSizes;
+	std::vector<Block> blocks;
+	std::vector<BlockSection> sections;
+	uint64_t offset;
+	bool closed;
+};
+
+class BlockReader
+{
+public:
+
+	BlockReader();
+	~BlockReader();
+	
+	BlockCodec getCodec() const;
+	int getBlockCount() const;
+	int getFlags() const;
+	uint64_t getOffset(int block) const;
+	const BlockSection & getSection(int index) const;
+	int getSectionCount() const;
+	uint64_t getSize(int blockStart, int blockCount) const;
+	bool isContiguous(int blockStart, int blockCount) const;
+	bool open(const char * file);
+	bool read(int blockStart, int blockCount, char * data, ThreadPool * pool = 0) const;
+
+private:
+
+	struct Block
+	{
+		uint64_t offset;
+		uint32_t sizeCompressed;
+		uint32_t size;
+		uint64_t position; // uncompressed offset from the start of the first block
+	};
+	
+	bool readBlock(int index, char * data) const;
+	
+	int fd;
+	BlockCodec codec;
+	int flags;
+	std::vector<Block> blocks;
+	std::vector<BlockSection> sections;
+};
+
+inline int BlockWriter::getBlockCount() const { return blocks.size() + pending.size(); }
+inline BlockCodec BlockReader::getCodec() const { return codec; }
+inline int BlockReader::getBlockCount() const { return blocks.size(); }
+inline int BlockReader::getFlags() const { return flags; }
+inline uint64_t BlockReader::getOffset(int block) const { return blocks.at(block).offset; }
+inline const BlockSection & BlockReader::getSection(int index) const { return sections.at(index); }
+inline int BlockReader::getSectionCount() const { return sections.size(); }
+
+#endif
@@ -0,0 +1,300 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "harvest/FilterBitmap.h"
+#include <algorithm>
+
+using namespace::std;
+
+template<class Value>
+static void appendValue(string & data, Value value)
+{
+	for ( int i = 0; i < sizeof(Value); i++ )
+	{
+		data.push_back((char)(value >> (8 * i)));
+	}
+}
+
+template<class Value>
+static bool readValue(const uint8_t *& data, const uint8_t * end, Value & value)
+{
+	if ( end - data < sizeof(Value) )
+	{
+		return false;
+	}
+	
+	value = 0;
+	
+	for ( int i = 0; i < sizeof(Value); i++ )
+	{
+		value |= (Value)data[i] << (8 * i);
+	}
+	
+	data += sizeof(Value);
+	return true;
+}
+
+FilterBitmap::FilterBitmap()
+{
+	count = 0;
+}
+
+void FilterBitmap::add(uint32_t value)
+{
+	Container * container = findContainer(value >> 16, true);
+	uint16_t low = value & 0xffff;
+	
+	if ( container->bits.size() )
+	{
+		uint64_t bit = (uint64_t)1 << (low % 64);
+		
+		if ( container->bits[low / 64] & bit )
+		{
+			return;
+		}
+		
+		container->bits[low / 64] |= bit;
+	}
+	else
+	{
+		// usually appended, since variants are flagged in order
+		
+		vector<uint16_t> & values = container->values;
+		vector<uint16_t>::iterator i = values.size() && values.back() < low ? values.end() : lower_bound(values.begin(), values.end(), low);
+		
+		if ( i != values.end() && *i == low )
+		{
+			return;
+		}
+		
+		values.insert(i, low);
+		
+		if ( values.size() > arrayMax )
+		{
+			container->bits.assign(bitsetWords, 0);
+			
+			for ( int j = 0; j < values.size(); j++ )
+			{
+				container->bits[values[j] / 64] |= (uint64_t)1 << (values[j] % 64);
+			}
+			
+			vector<uint16_t>().swap(values);
+		}
+	}
+	
+	container->count++;
+	count++;
+}
+
+void FilterBitmap::clear()
+{
+	containers.clear();
+	count = 0;
+}
+
+bool FilterBitmap::contains(uint32_t value) const
+{
+	Container * container = const_cast<FilterBitmap *>(this)->findContainer(value >> 16, false);
+	uint16_t low = value & 0xffff;
+	
+	if ( container == 0 )
+	{
+		return false;
+	}
+	
+	if ( container->bits.size() )
+	{
+		return container->bits[low / 64] >> (low % 64) & 1;
+	}
+	
+	return binary_search(container->values.begin(), container->values.end(), low);
+}
+
+FilterBitmap::Container * FilterBitmap::findContainer(uint16_t key, bool create)
+{
+	if ( containers.size() && containers.back().key == key )
+	{
+		return &containers.back();
+	}
+	
+	int lower = 0;
+	int upper = containers.size();
+	
+	while ( lower < upper )
+	{
+		int middle = (lower + upper) / 2;
+		
+		if ( containers[middle].key < key )
+		{
+			lower = middle + 1;
+		}
+		else
+		{
+			upper = middle;
+		}
+	}
+	
+	if ( lower < containers.size() && containers[lower].key == key )
+	{
+		return &containers[lower];
+	}
+	
+	if ( ! create )
+	{
+		return 0;
+	}
+	
+	Container container;
+	
+	container.key = key;
+	container.count = 0;
+	
+	return &*containers.insert(containers.begin() + lower, container);
+}
+
+void FilterBitmap::getValues(vector<uint32_t> & values) const
+{
+	values.clear();
+	values.reserve(count);
+	
+	for ( int i = 0; i < containers.size(); i++ )
+	{
+		const Container & container = containers[i];
+		uint32_t high = (uint32_t)container.key << 16;
+		
+		if ( container.bits.size() )
+		{
+			for ( int j = 0; j < bitsetWords; j++ )
+			{
+				for ( uint64_t word = container.bits[j]; word; word &= word - 1 )
+				{
+					values.push_back(high | (j * 64 + __builtin_ctzll(word)));
+				}
+			}
+		}
+		else
+		{
+			for ( int j = 0; j < container.values.size(); j++ )
+			{
+				values.push_back(high | container.values[j]);
+			}
+		}
+	}
+}
+
+bool FilterBitmap::initFromData(const uint8_t * data, size_t size)
+{
+	const uint8_t * end = data + size;
+	uint32_t containerCount;
+	
+	clear();
+	
+	if ( ! readValue(data, end, containerCount) )
+	{
+		return false;
+	}
+	
+	for ( int i = 0; i < containerCount; i++ )
+	{
+		Container container;
+		uint16_t kind;
+		
+		if
+		(
+			! readValue(data, end, container.key) ||
+			! readValue(data, end, kind) ||
+			! readValue(data, end, container.count) ||
+			(containers.size() && container.key <= containers.back().key)
+		)
+		{
+			clear();
+			return false;
+		}
+		
+		if ( kind == 1 )
+		{
+			if ( end - data < bitsetWords * sizeof(uint64_t) )
+			{
+				clear();
+				return false;
+			}
+			
+			uint32_t bitCount = 0;
+			
+			container.bits.resize(bitsetWords);
+			
+			for ( int j = 0; j < bitsetWords; j++ )
+			{
+				readValue(data, end, container.bits[j]);
+				bitCount += __builtin_popcountll(container.bits[j]);
+			}
+			
+			if ( bitCount != container.count )
+			{
+				clear();
+				return false;
+			}
+		}
+		else
+		{
+			if ( kind != 0 || container.count > arrayMax || end - data < container.count * sizeof(uint16_t) )
+			{
+				clear();
+				return false;
+			}
+			
+			container.values.resize(container.count);
+			
+			for ( int j = 0; j < container.count; j++ )
+			{
+				// must be strictly increasing for lookups
+				
+				readValue(data, end, container.values[j]);
+				
+				if ( j && container.values[j] <= container.values[j - 1] )
+				{
+					clear();
+					return false;
+				}
+			}
+		}
+		
+		containers.push_back(container);
+		count += container.count;
+	}
+	
+	return true;
+}
+
+void FilterBitmap::writeToData(string & data) const
+{
+	data.clear();
+	appendValue(data, (uint32_t)containers.size());
+	
+	for ( int i = 0; i < containers.size(); i++ )
+	{
+		const Container & container = containers[i];
+		
+		appendValue(data, container.key);
+		appendValue(data, (uint16_t)(container.bits.size() ? 1 : 0));
+		appendValue(data, container.count);
+		
+		if ( container.bits.size() )
+		{
+			for ( int j = 0; j < bitsetWords; j++ )
+			{
+				appendValue(data, container.bits[j]);
+			}
+		}
+		else
+		{
+			for ( int j = 0; j < container.values.size(); j++ )
+			{
+				appendValue(data, container.values[j]);
+			}
+		}
+	}
+}
@@ -0,0 +1,59 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef FilterBitmap_h
+#define FilterBitmap_h
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed set of variant indices, laid out like a Roaring bitmap: values
+// are split by their upper 16 bits into containers, which hold the lower 16
+// bits as a sorted array while sparse and as a 65536-bit bitset once dense.
+// Cardinalities are kept, so counts never touch the values.
+//
+// Serialized (little-endian) as a container count (32 bits), then for each
+// container its key (16 bits), kind (16 bits; 0 array, 1 bitset), count
+// (32 bits) and either count 16-bit values or 1024 64-bit words.
+
+class FilterBitmap
+{
+public:
+
+	FilterBitmap();
+	
+	void add(uint32_t value);
+	void clear();
+	bool contains(uint32_t value) const;
+	uint64_t getCount() const;
+	void getValues(std::vector<uint32_t> & values) const;
+	bool initFromData(const uint8_t * data, size_t size);
+	void writeToData(std::string & data) const;
+
+private:
+
+	struct Container
+	{
+		uint16_t key;
+		uint32_t count;
+		std::vector<uint16_t> values; // sorted, while count <= arrayMax
+		std::vector<uint64_t> bits; // bitsetWords, once dense
+	};
+	
+	static const uint32_t arrayMax = 4096; // where a bitset becomes smaller
+	static const int bitsetWords = 1024;
+	
+	Container * findContainer(uint16_t key, bool create);
+	
+	std::vector<Container> containers; // by key
+	uint64_t count;
+};
+
+inline uint64_t FilterBitmap::getCount() const { return count; }
+
+#endif
@@ -0,0 +1,215 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "harvest/FilterExpression.h"
+#include "harvest/VariantList.h"
+#include <ctype.h>
+
+using namespace::std;
+
+void FilterExpression::compile(const string & expression, const VariantList & variantList)
+{
+	program.clear();
+	leaves.clear();
+	
+	text = &expression;
+	list = &variantList;
+	position = 0;
+	
+	parseOr();
+	skipSpace();
+	
+	if ( position < expression.length() )
+	{
+		throw ParseException("unexpected '" + expression.substr(position, 1) + "'", position);
+	}
+	
+	// evaluate() keeps operands in a fixed stack
+	
+	int depth = 0;
+	
+	for ( int i = 0; i < program.size(); i++ )
+	{
+		if ( program[i].type == OP_leaf )
+		{
+			depth++;
+		}
+		else if ( program[i].type != OP_not )
+		{
+			depth--;
+		}
+		
+		if ( depth > stackMax )
+		{
+			throw ParseException("too deeply nested", 0);
+		}
+	}
+}
+
+uint64_t FilterExpression::evaluate(const uint64_t * words) const
+{
+	uint64_t stack[stackMax];
+	int depth = 0;
+	
+	for ( int i = 0; i < program.size(); i++ )
+	{
+		const Op & op = program[i];
+		
+		switch ( op.type )
+		{
+			case OP_leaf:
+				stack[depth++] = words[op.leaf];
+				break;
+			case OP_not:
+				stack[depth - 1] = ~stack[depth - 1];
+				break;
+			case OP_and:
+				depth--;
+				stack[depth - 1] &= stack[depth];
+				break;
+			case OP_or:
+				depth--;
+				stack[depth - 1] |= stack[depth];
+				break;
+		}
+	}
+	
+	return stack[0];
+}
+
+void FilterExpression::parseAnd()
+{
+	parseNot();
+	
+	while ( true )
+	{
+		skipSpace();
+		
+		if ( position == text->length() || (*text)[position] != '&' )
+		{
+			return;
+		}
+		
+		position++;
+		parseNot();
+		
+		Op op = {OP_and, 0};
+		program.push_back(op);
+	}
+}
+
+void FilterExpression::parseNot()
+{
+	skipSpace();
+	
+	if ( position == text->length() )
+	{
+		throw ParseException("expected filter", position);
+	}
+	
+	char c = (*text)[position];
+	
+	if ( c == '!' )
+	{
+		position++;
+		parseNot();
+		
+		Op op = {OP_not, 0};
+		program.push_back(op);
+	}
+	else if ( c == '(' )
+	{
+		int open = position;
+		
+		position++;
+		parseOr();
+		skipSpace();
+		
+		if ( position == text->length() || (*text)[position] != ')' )
+		{
+			throw ParseException("unmatched '('", open);
+		}
+		
+		position++;
+	}
+	else
+	{
+		int start = position;
+		
+		while ( position < text->length() && (isalnum((*text)[position]) || (*text)[position] == '_' || (*text)[position] == '-' || (*text)[position] == '.') )
+		{
+			position++;
+		}
+		
+		if ( position == start )
+		{
+			throw ParseException(string("unexpected '") + c + "'", position);
+		}
+		
+		string name = text->substr(start, position - start);
+		int filter;
+		
+		if ( name == "PASS" )
+		{
+			filter = -1;
+		}
+		else
+		{
+			for ( filter = 0; filter < list->getFilterCount(); filter++ )
+			{
+				if ( list->getFilter(filter).name == name )
+				{
+					break;
+				}
+			}
+			
+			if ( filter == list->getFilterCount() )
+			{
+				throw ParseException("unknown filter \"" + name + "\"", start);
+			}
+		}
+		
+		Op op = {OP_leaf, 0};
+		
+		for ( op.leaf = 0; op.leaf < leaves.size() && leaves[op.leaf] != filter; op.leaf++ );
+		
+		if ( op.leaf == leaves.size() )
+		{
+			leaves.push_back(filter);
+		}
+		
+		program.push_back(op);
+	}
+}
+
+void FilterExpression::parseOr()
+{
+	parseAnd();
+	
+	while ( true )
+	{
+		skipSpace();
+		
+		if ( position == text->length() || (*text)[position] != '|' )
+		{
+			return;
+		}
+		
+		position++;
+		parseAnd();
+		
+		Op op = {OP_or, 0};
+		program.push_back(op);
+	}
+}
+
+void FilterExpression::skipSpace()
+{
+	while ( position < text->length() && isspace((*text)[position]) )
+	{
+		position++;
+	}
+}
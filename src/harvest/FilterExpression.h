@@ -0,0 +1,83 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef FilterExpression_h
+#define FilterExpression_h
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class VariantList;
+
+// Boolean expression over the filters of a variant list, such as
+// "!IND & !CID & (LCB | PHAGE)", which is true for variants to keep. It is
+// compiled to a postfix program over words of 64 variants, with a word per
+// filter named (see VariantList::getSelection()). Operators are ! (not),
+// & (and) and | (or), by decreasing precedence; PASS is true for variants
+// with no filters.
+
+class FilterExpression
+{
+public:
+
+	class ParseException : public std::exception
+	{
+	public:
+	
+		ParseException(const std::string & messageNew, int positionNew)
+		{
+			message = messageNew;
+			position = positionNew;
+		}
+		
+		virtual ~ParseException() throw() {}
+		
+		std::string message;
+		int position; // in the expression
+	};
+	
+	void compile(const std::string & expression, const VariantList & variantList); // throws ParseException
+	uint64_t evaluate(const uint64_t * words) const; // one word per leaf
+	const std::vector<int> & getLeaves() const; // filters, or -1 for PASS
+
+private:
+
+	enum OpType
+	{
+		OP_leaf,
+		OP_not,
+		OP_and,
+		OP_or,
+	};
+	
+	struct Op
+	{
+		OpType type;
+		int leaf;
+	};
+	
+	static const int stackMax = 64;
+	
+	void parseAnd();
+	void parseNot();
+	void parseOr();
+	void skipSpace();
+	
+	std::vector<Op> program;
+	std::vector<int> leaves;
+	
+	// parser state
+	//
+	const std::string * text;
+	const VariantList * list;
+	int position;
+};
+
+inline const std::vector<int> & FilterExpression::getLeaves() const { return leaves; }
+
+#endif
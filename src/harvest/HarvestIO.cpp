@@ -9,12 +9,16 @@
 #include <google/protobuf/io/gzip_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/arena.h>
 #include <capnp/message.h>
 #include <capnp/serialize.h>
+#include <capnp/serialize-packed.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include "parse.h"
+#include "harvest/MappedFile.h"
+#include "harvest/ProtocolBufferReader.h"
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
@@ -30,6 +34,223 @@
 using namespace::std;
 using namespace::google::protobuf::io;
 
+// feeds a serialized Cap'n Proto message to the block compressor
+//
+class BlockOutputStream : public kj::OutputStream
+{
+public:
+
+	BlockOutputStream(BlockWriter & writerNew) : writer(writerNew) {}
+	
+	void write(const void * buffer, size_t size)
+	{
+		writer.write(buffer, size);
+	}
+
+private:
+
+	BlockWriter & writer;
+};
+
+static capnp::ReaderOptions getReaderOptions()
+{
+	capnp::ReaderOptions readerOptions;
+	
+	readerOptions.traversalLimitInWords = 1000000000000;
+	readerOptions.nestingLimit = 1000000;
+	
+	return readerOptions;
+}
+
+// Copy protocol buffer messages straight into Cap'n Proto builders for
+// HarvestIO::upgradeHarvest, without going through the lists.
+
+static void upgradeAnnotations(const Harvest::AnnotationList & msg, capnp::Harvest::Builder & harvestBuilder)
+{
+	auto annotationsBuilder = harvestBuilder.initAnnotationList().initAnnotations(msg.annotations_size());
+	
+	for ( int i = 0; i < msg.annotations_size(); i++ )
+	{
+		const Harvest::AnnotationList::Annotation & msgAnn = msg.annotations(i);
+		auto annotationBuilder = annotationsBuilder[i];
+		auto regionsBuilder = annotationBuilder.initRegions(msgAnn.regions_size());
+		
+		for ( int j = 0; j < msgAnn.regions_size(); j++ )
+		{
+			auto regionBuilder = regionsBuilder[j];
+			
+			regionBuilder.setStart(msgAnn.regions(j).start());
+			regionBuilder.setEnd(msgAnn.regions(j).end());
+			regionBuilder.setReverse(msgAnn.regions(j).reverse());
+		}
+		
+		annotationBuilder.setSequence(msgAnn.sequence());
+		annotationBuilder.setReverse(msgAnn.reverse());
+		annotationBuilder.setName(msgAnn.name());
+		annotationBuilder.setLocus(msgAnn.locus());
+		annotationBuilder.setDescription(msgAnn.description());
+		annotationBuilder.setFeature(msgAnn.feature());
+	}
+}
+
+static void upgradeLcbs(const vector<Harvest::Alignment::Lcb> & msgLcbs, int count, capnp::Harvest::Builder & harvestBuilder)
+{
+	auto lcbsBuilder = harvestBuilder.initLcbList().initLcbs(count);
+	
+	for ( int i = 0; i < count; i++ )
+	{
+		const Harvest::Alignment::Lcb & msgLcb = msgLcbs[i];
+		auto lcbBuilder = lcbsBuilder[i];
+		auto regionsBuilder = lcbBuilder.initRegions(msgLcb.regions_size());
+		
+		lcbBuilder.setSequence(msgLcb.sequence());
+		lcbBuilder.setPosition(msgLcb.position());
+		lcbBuilder.setLength(msgLcb.length());
+		lcbBuilder.setConcordance(msgLcb.concordance());
+		
+		for ( int j = 0; j < msgLcb.regions_size(); j++ )
+		{
+			const Harvest::Alignment::Lcb::Region & msgRegion = msgLcb.regions(j);
+			auto regionBuilder = regionsBuilder[j];
+			
+			regionBuilder.setTrack(j); // as LcbList::writeToCapnp
+			regionBuilder.setPosition(msgRegion.position());
+			regionBuilder.setLength(msgRegion.length());
+			regionBuilder.setReverse(msgRegion.reverse());
+		}
+	}
+}
+
+static void upgradeTracks(const Harvest::TrackList & msg, capnp::Harvest::Builder & harvestBuilder)
+{
+	auto trackListBuilder = harvestBuilder.initTrackList();
+	auto tracksBuilder = trackListBuilder.initTracks(msg.tracks_size());
+	
+	for ( int i = 0; i < msg.tracks_size(); i++ )
+	{
+		const Harvest::TrackList::Track & msgTrack = msg.tracks(i);
+		auto trackBuilder = tracksBuilder[i];
+		
+		if ( msgTrack.has_file() )
+		{
+			trackBuilder.setFile(msgTrack.file());
+		}
+		
+		if ( msgTrack.has_name() )
+		{
+			trackBuilder.setName(msgTrack.name());
+		}
+		
+		trackBuilder.setSize(msgTrack.size());
+		trackBuilder.setType((capnp::Harvest::TrackList::Track::TrackType)msgTrack.type());
+	}
+	
+	trackListBuilder.setVariantReference(msg.variantreference());
+}
+
+static void upgradeTreeNode(const Harvest::Tree::Node & msgNode, capnp::Harvest::Tree::Node::Builder & nodeBuilder)
+{
+	if ( msgNode.children_size() )
+	{
+		auto childrenBuilder = nodeBuilder.initChildren(msgNode.children_size());
+		
+		for ( int i = 0; i < msgNode.children_size(); i++ )
+		{
+			auto childBuilder = childrenBuilder[i];
+			upgradeTreeNode(msgNode.children(i), childBuilder);
+		}
+		
+		nodeBuilder.setBootstrap(msgNode.bootstrap());
+	}
+	else
+	{
+		nodeBuilder.setTrack(msgNode.track());
+	}
+	
+	nodeBuilder.setBranchLength(msgNode.branchlength());
+}
+
+static void upgradeTree(const Harvest::Tree & msg, capnp::Harvest::Builder & harvestBuilder)
+{
+	auto treeBuilder = harvestBuilder.initTree();
+	auto rootBuilder = treeBuilder.initRoot();
+	
+	treeBuilder.setMultiplier(msg.has_multiplier() ? msg.multiplier() : 1.0);
+	upgradeTreeNode(msg.root(), rootBuilder);
+}
+
+static void upgradeVariants(const vector<Harvest::Variation::Filter> & msgFilters, const vector<Harvest::Variation::Variant> & msgVariants, int count, capnp::Harvest::Builder & harvestBuilder)
+{
+	auto variantListBuilder = harvestBuilder.initVariantList();
+	auto filtersBuilder = variantListBuilder.initFilters(msgFilters.size());
+	auto variantsBuilder = variantListBuilder.initVariants(count);
+	
+	for ( int i = 0; i < msgFilters.size(); i++ )
+	{
+		auto filterBuilder = filtersBuilder[i];
+		
+		filterBuilder.setFlag(msgFilters[i].flag());
+		filterBuilder.setName(msgFilters[i].name());
+		filterBuilder.setDescription(msgFilters[i].description());
+	}
+	
+	if ( count )
+	{
+		variantListBuilder.setAlleleCount(msgVariants[0].alleles().length());
+	}
+	
+	string packed;
+	string escapes;
+	
+	for ( int i = 0; i < count; i++ )
+	{
+		const Harvest::Variation::Variant & msgVariant = msgVariants[i];
+		auto variantBuilder = variantsBuilder[i];
+		
+		VariantList::packAlleles(msgVariant.alleles().c_str(), msgVariant.alleles().length(), packed, escapes);
+		
+		variantBuilder.setSequence(msgVariant.sequence());
+		variantBuilder.setPosition(msgVariant.position());
+		variantBuilder.setAllelesPacked(capnp::Data::Reader((const kj::byte *)packed.data(), packed.length()));
+		variantBuilder.setFilters(msgVariant.filters());
+		
+		if ( escapes.length() )
+		{
+			variantBuilder.setAlleleEscapes(escapes);
+		}
+		
+		variantBuilder.setQuality(msgVariant.quality());
+		
+		if ( msgVariant.has_reference() )
+		{
+			variantBuilder.setReference(msgVariant.reference());
+		}
+		else if ( msgVariant.alleles().length() )
+		{
+			variantBuilder.setReference(msgVariant.alleles()[0]);
+		}
+	}
+	
+	// bitmaps by chunk index, as VariantList::writeToCapnp stores them
+	
+	vector<FilterBitmap> bitmaps(msgFilters.size());
+	
+	for ( int i = 0; i < count; i++ )
+	{
+		uint64_t flags = msgVariants[i].filters();
+		
+		for ( int j = 0; flags && j < msgFilters.size(); j++ )
+		{
+			if ( flags & msgFilters[j].flag() )
+			{
+				bitmaps[j].add(i);
+			}
+		}
+	}
+	
+	VariantList::writeFilterBitmapsToCapnp(bitmaps, variantListBuilder);
+}
+
 HarvestIO::HarvestIO()
 {
 	GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -47,7 +268,14 @@ void HarvestIO::clear()
 
 void HarvestIO::loadBed(const char * file, const char * name, const char * desc)
 {
-	variantList.addFilterFromBed(file, name, desc);
+	VariantList::BedFilter bed = {file, name, desc};
+	
+	loadBeds(vector<VariantList::BedFilter>(1, bed));
+}
+
+void HarvestIO::loadBeds(const vector<VariantList::BedFilter> & beds)
+{
+	variantList.addFiltersFromBed(beds, &referenceList);
 }
 
 void HarvestIO::loadFasta(const char * file)
@@ -55,23 +283,94 @@ void HarvestIO::loadFasta(const char * file)
 	referenceList.initFromFasta(file);
 }
 
+bool HarvestIO::loadFilterCounts(const char * file, vector<uint64_t> & counts)
+{
+	// Counts are summed from the bitmaps stored with each variant chunk, so
+	// the variants themselves are never read (though compressed chunks are
+	// still inflated). Files without bitmaps must be loaded instead.
+	
+	ifstream in(file);
+	
+	char header[blockHeaderLength] = {0};
+	
+	in.read(header, blockHeaderLength);
+	in.close();
+	
+	if ( strncmp(header, capnpHeader, capnpHeaderLength) != 0 || header[capnpHeaderLength] != 0 )
+	{
+		return false;
+	}
+	
+	BlockReader reader;
+	
+	if ( ! reader.open(file) || ! isCodecAvailable(reader.getCodec()) )
+	{
+		return false;
+	}
+	
+	MappedFile mappedFile;
+	
+	if ( reader.getCodec() == CODEC_none && ! mappedFile.open(file) )
+	{
+		return false;
+	}
+	
+	ThreadPool pool;
+	
+	auto addCounts = [&](const capnp::Harvest::Reader & harvestReader)
+	{
+		return ! harvestReader.hasVariantList() || variantList.addFilterCountsFromCapnp(harvestReader, counts);
+	};
+	
+	counts.clear();
+	
+	if ( reader.getSectionCount() == 0 )
+	{
+		return readHarvestSection(file, reader, mappedFile, pool, 0, reader.getBlockCount(), addCounts);
+	}
+	
+	for ( int i = 0; i < reader.getSectionCount(); i++ )
+	{
+		const BlockSection & section = reader.getSection(i);
+		
+		if ( section.type == SECTION_variants && ! readHarvestSection(file, reader, mappedFile, pool, section.blockStart, section.blockCount, addCounts) )
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
 void HarvestIO::loadGenbank(const char * file, bool useSeq)
 {
 	annotationList.initFromGenbank(file, referenceList, useSeq);
 }
 
-bool HarvestIO::loadHarvest(const char * file)
+bool HarvestIO::loadHarvest(const char * file, int sections)
 {
 	ifstream in(file);
 	
-	char header[capnpHeaderLength];
+	char header[blockHeaderLength] = {0};
 	
-	in.read(header, capnpHeaderLength);
+	in.read(header, blockHeaderLength);
 	in.close();
 	
-	if ( false || strncmp(header, capnpHeader, capnpHeaderLength) == 0 )
+	if ( sections & SECTION_annotations )
+	{
+		sections |= SECTION_references; // annotations are matched to references
+	}
+	
+	if ( strncmp(header, capnpHeader, capnpHeaderLength) == 0 )
 	{
-		return loadHarvestCapnp(file);
+		if ( header[capnpHeaderLength] == 0 )
+		{
+			return loadHarvestBlocks(file, sections);
+		}
+		else
+		{
+			return loadHarvestCapnp(file, sections);
+		}
 	}
 	else
 	{
@@ -79,7 +378,72 @@ bool HarvestIO::loadHarvest(const char * file)
 	}
 }
 
-bool HarvestIO::loadHarvestCapnp(const char * file)
+bool HarvestIO::loadHarvestBlocks(const char * file, int sections, uint64_t keyStart, uint64_t keyEnd)
+{
+	BlockReader reader;
+	
+	if ( ! reader.open(file) )
+	{
+		cerr << "ERROR: could not read block index of " << file << ".\n";
+		return false;
+	}
+	
+	if ( ! isCodecAvailable(reader.getCodec()) )
+	{
+		cerr << "ERROR: " << file << " is compressed with " << getCodecName(reader.getCodec()) << ", which this build does not support.\n";
+		return false;
+	}
+	
+	MappedFile mappedFile;
+	
+	if ( reader.getCodec() == CODEC_none && ! mappedFile.open(file) )
+	{
+		cerr << "ERROR: could not map " << file << ".\n";
+		return false;
+	}
+	
+	ThreadPool pool;
+	
+	if ( reader.getSectionCount() == 0 )
+	{
+		// a single message with all sections
+		
+		return loadHarvestSection(file, reader, mappedFile, pool, 0, reader.getBlockCount(), sections, 0);
+	}
+	
+	// Sections are stored in the order they must be initialized, so
+	// annotations come after the references they are matched to. Large
+	// sections are split into chunks, which are appended to the first;
+	// variant chunks outside the key range are skipped.
+	
+	int sectionsLoaded = 0;
+	
+	for ( int i = 0; i < reader.getSectionCount(); i++ )
+	{
+		const BlockSection & section = reader.getSection(i);
+		
+		if ( (section.type & sections) == 0 )
+		{
+			continue;
+		}
+		
+		if ( section.type == SECTION_variants && (section.keyEnd < keyStart || section.keyStart > keyEnd) )
+		{
+			continue;
+		}
+		
+		if ( ! loadHarvestSection(file, reader, mappedFile, pool, section.blockStart, section.blockCount, sections, sectionsLoaded) )
+		{
+			return false;
+		}
+		
+		sectionsLoaded |= section.type;
+	}
+	
+	return true;
+}
+
+bool HarvestIO::loadHarvestCapnp(const char * file, int sections)
 {
 	// use a pipe to decompress input to Cap'n Proto
 	
@@ -148,106 +512,301 @@ bool HarvestIO::loadHarvestCapnp(const char * file)
 	
 	close(fds[1]); // other process's end of pipe
 	
-	capnp::ReaderOptions readerOptions;
-	
-	readerOptions.traversalLimitInWords = 1000000000000;
-	readerOptions.nestingLimit = 1000000;
-	
 	//char buffer[1024];
 	//read(fds[0], buffer, 1024);
 	//printf("data: %s\n", buffer);
 	//return true;
 	
-	capnp::StreamFdMessageReader message(fds[0], readerOptions);
+	capnp::StreamFdMessageReader message(fds[0], getReaderOptions());
+	
+	initFromCapnp(message.getRoot<capnp::Harvest>(), sections, 0);
+	
+	close(fds[0]);
+	return true;
+}
+
+bool HarvestIO::loadHarvestSection(const char * file, const BlockReader & reader, const MappedFile & mappedFile, ThreadPool & pool, int blockStart, int blockCount, int sections, int sectionsAppend)
+{
+	return readHarvestSection(file, reader, mappedFile, pool, blockStart, blockCount, [&](const capnp::Harvest::Reader & harvestReader)
+	{
+		initFromCapnp(harvestReader, sections, sectionsAppend);
+		return true;
+	});
+}
+
+bool HarvestIO::readHarvestSection(const char * file, const BlockReader & reader, const MappedFile & mappedFile, ThreadPool & pool, int blockStart, int blockCount, const function<bool(const capnp::Harvest::Reader &)> & init)
+{
+	uint64_t size = reader.getSize(blockStart, blockCount);
+	bool packed = reader.getFlags() & BLOCK_FLAG_packed;
+	
+	if ( ! packed && size % sizeof(capnp::word) != 0 )
+	{
+		cerr << "ERROR: " << file << " does not contain a valid message.\n";
+		return false;
+	}
 	
-	capnp::Harvest::Reader harvestReader = message.getRoot<capnp::Harvest>();
+	const char * data;
+	kj::Array<capnp::word> words;
 	
-	if ( harvestReader.hasReferenceList() )
+	if ( mappedFile.getData() && reader.isContiguous(blockStart, blockCount) )
+	{
+		// uncompressed; read the message in place from the memory map
+		
+		data = mappedFile.getData() + (blockCount ? reader.getOffset(blockStart) : 0);
+	}
+	else
 	{
-		referenceList.initFromCapnp(harvestReader);
+		// decompress the blocks in parallel into one word-aligned buffer
+		
+		words = kj::heapArray<capnp::word>((size + sizeof(capnp::word) - 1) / sizeof(capnp::word));
+		data = (const char *)words.begin();
+		
+		if ( ! reader.read(blockStart, blockCount, (char *)words.begin(), &pool) )
+		{
+			cerr << "ERROR: could not decompress " << file << ".\n";
+			return false;
+		}
 	}
 	
-	if ( harvestReader.hasAnnotationList() )
+	if ( packed )
+	{
+		kj::ArrayInputStream input(kj::arrayPtr((const kj::byte *)data, size));
+		capnp::PackedMessageReader message(input, getReaderOptions());
+		
+		return init(message.getRoot<capnp::Harvest>());
+	}
+	else
+	{
+		capnp::FlatArrayMessageReader message(kj::arrayPtr((const capnp::word *)data, size / sizeof(capnp::word)), getReaderOptions());
+		
+		return init(message.getRoot<capnp::Harvest>());
+	}
+}
+
+void HarvestIO::initFromCapnp(const capnp::Harvest::Reader & harvestReader, int sections, int sectionsAppend)
+{
+	if ( (sections & SECTION_references) && harvestReader.hasReferenceList() )
+	{
+		referenceList.initFromCapnp(harvestReader, sectionsAppend & SECTION_references);
+	}
+	
+	if ( (sections & SECTION_annotations) && harvestReader.hasAnnotationList() )
 	{
 		annotationList.initFromCapnp(harvestReader, referenceList);
 	}
 	
-	trackList.initFromCapnp(harvestReader);
+	if ( (sections & SECTION_tracks) && harvestReader.hasTrackList() )
+	{
+		trackList.initFromCapnp(harvestReader);
+	}
 	
-	if ( harvestReader.hasTree() )
+	if ( (sections & SECTION_tree) && harvestReader.hasTree() )
 	{
 		phylogenyTree.initFromCapnp(harvestReader);
 	}
 	
-	if ( harvestReader.hasLcbList() )
+	if ( (sections & SECTION_lcbs) && harvestReader.hasLcbList() )
 	{
-		lcbList.initFromCapnp(harvestReader);
+		lcbList.initFromCapnp(harvestReader, sectionsAppend & SECTION_lcbs);
 	}
 	
-	if ( harvestReader.hasVariantList() )
+	if ( (sections & SECTION_variants) && harvestReader.hasVariantList() )
 	{
-		variantList.initFromCapnp(harvestReader);
+		variantList.initFromCapnp(harvestReader, sectionsAppend & SECTION_variants);
 	}
-	
-	close(fds[0]);
-	return true;
 }
 
 bool HarvestIO::loadHarvestProtocolBuffer(const char * file)
 {
-	Harvest harvest;
+	// The file is walked field by field rather than parsed whole, and the
+	// variants are read one at a time straight into the variant list, so
+	// only one copy of the data is held and size is not limited to 2GB.
+	// Messages are allocated on arenas, which are freed in one go after
+	// each section is copied into its list.
 	
-	int fd = open(file, O_RDONLY);
+	ProtocolBufferReader reader;
 	
-	if ( fd < 0 )
+	if ( ! reader.open(file) )
 	{
 		return false;
 	}
 	
-	FileInputStream raw_input(fd);
-	GzipInputStream gz(&raw_input);
-	CodedInputStream coded_input(&gz);
+	google::protobuf::Arena arena;
+	google::protobuf::Arena arenaAnnotations; // kept until references are in
+	Harvest::AnnotationList * msgAnnotations = 0;
+	int field;
+	bool success = true;
 	
-	coded_input.SetTotalBytesLimit(INT_MAX, INT_MAX);
-	
-	if ( ! harvest.ParseFromCodedStream(&coded_input) )
+	while ( success && reader.next(field) )
 	{
-		printf("FAIL!\n");
-		return false;
+		switch ( field )
+		{
+			case Harvest::kReferenceFieldNumber:
+			{
+				Harvest::Reference * msg = google::protobuf::Arena::CreateMessage<Harvest::Reference>(&arena);
+				
+				success = reader.read(msg);
+				
+				if ( success )
+				{
+					referenceList.initFromProtocolBuffer(*msg);
+				}
+				
+				break;
+			}
+			case Harvest::kAnnotationsFieldNumber:
+				msgAnnotations = google::protobuf::Arena::CreateMessage<Harvest::AnnotationList>(&arenaAnnotations);
+				success = reader.read(msgAnnotations);
+				break;
+			
+			case Harvest::kTracksFieldNumber:
+			{
+				Harvest::TrackList * msg = google::protobuf::Arena::CreateMessage<Harvest::TrackList>(&arena);
+				
+				success = reader.read(msg);
+				
+				if ( success )
+				{
+					trackList.initFromProtocolBuffer(*msg);
+				}
+				
+				break;
+			}
+			case Harvest::kTreeFieldNumber:
+			{
+				Harvest::Tree * msg = google::protobuf::Arena::CreateMessage<Harvest::Tree>(&arena);
+				
+				success = reader.read(msg);
+				
+				if ( success )
+				{
+					phylogenyTree.initFromProtocolBuffer(*msg);
+				}
+				
+				break;
+			}
+			case Harvest::kAlignmentFieldNumber:
+			{
+				Harvest::Alignment * msg = google::protobuf::Arena::CreateMessage<Harvest::Alignment>(&arena);
+				
+				success = reader.read(msg);
+				
+				if ( success )
+				{
+					lcbList.initFromProtocolBuffer(*msg);
+				}
+				
+				break;
+			}
+			case Harvest::kVariationFieldNumber:
+				success = loadVariationProtocolBuffer(reader, arena);
+				break;
+			
+			default:
+				success = reader.skip();
+		}
+		
+		arena.Reset();
 	}
 	
-	if ( harvest.has_reference() )
+	if ( ! success || reader.getFailed() )
 	{
-		referenceList.initFromProtocolBuffer(harvest.reference());
+		cerr << "ERROR: could not parse " << file << ".\n";
+		return false;
 	}
 	
-	if ( harvest.has_annotations() )
+	if ( msgAnnotations )
 	{
-		annotationList.initFromProtocolBuffer(harvest.annotations(), referenceList);
+		annotationList.initFromProtocolBuffer(*msgAnnotations, referenceList);
 	}
 	
-	trackList.initFromProtocolBuffer(harvest.tracks());
+	return true;
+}
+
+bool HarvestIO::loadVariationProtocolBuffer(ProtocolBufferReader & reader, google::protobuf::Arena & arena)
+{
+	// filters and variants are added as they are read; one message of each
+	// is reused
+	
+	Harvest::Variation::Filter * msgFilter = google::protobuf::Arena::CreateMessage<Harvest::Variation::Filter>(&arena);
+	Harvest::Variation::Variant * msgVariant = google::protobuf::Arena::CreateMessage<Harvest::Variation::Variant>(&arena);
+	int field;
+	
+	variantList.clear();
 	
-	if ( harvest.has_tree() )
+	if ( ! reader.enter() )
 	{
-		phylogenyTree.initFromProtocolBuffer(harvest.tree());
+		return false;
 	}
 	
-	if ( harvest.has_alignment() )
+	while ( reader.next(field) )
 	{
-		lcbList.initFromProtocolBuffer(harvest.alignment());
+		switch ( field )
+		{
+			case Harvest::Variation::kFiltersFieldNumber:
+				if ( ! reader.read(msgFilter) )
+				{
+					return false;
+				}
+				
+				variantList.addFilterFromProtocolBuffer(*msgFilter);
+				break;
+			
+			case Harvest::Variation::kVariantsFieldNumber:
+				if ( ! reader.read(msgVariant) )
+				{
+					return false;
+				}
+				
+				variantList.addVariantFromProtocolBuffer(*msgVariant);
+				break;
+			
+			default:
+				if ( ! reader.skip() )
+				{
+					return false;
+				}
+		}
 	}
 	
-	if ( harvest.has_variation() )
+	return ! reader.getFailed();
+}
+
+bool HarvestIO::loadVariantsInRange(const char * file, int sequence, int start, int end)
+{
+	ifstream in(file);
+	
+	char header[blockHeaderLength] = {0};
+	
+	in.read(header, blockHeaderLength);
+	in.close();
+	
+	bool success;
+	
+	if ( strncmp(header, capnpHeader, capnpHeaderLength) == 0 && header[capnpHeaderLength] == 0 )
 	{
-		variantList.initFromProtocolBuffer(harvest.variation());
+		// only chunks that overlap the range are decompressed
+		
+		variantList.clear();
+		
+		success = loadHarvestBlocks
+		(
+			file,
+			SECTION_variants,
+			VariantList::getPositionKey(sequence, start),
+			VariantList::getPositionKey(sequence, end)
+		);
+	}
+	else
+	{
+		success = loadHarvest(file, SECTION_variants);
 	}
 	
-	harvest.Clear();
+	// chunks (and unindexed files) can hold variants outside the range
 	
-	close(fd);
-	google::protobuf::ShutdownProtobufLibrary();
-	return true;
+	variantList.removeVariantsOutsideRange(sequence, start, end);
+	
+	return success;
 }
 
 void HarvestIO::loadMaf(const char * file, bool findVariants, const char * referenceFileName)
@@ -280,139 +839,425 @@ void HarvestIO::loadXmfa(const char * file, bool findVariants)
 	lcbList.initFromXmfa(file, &referenceList, &trackList, &phylogenyTree, findVariants ? &variantList : 0);
 }
 
-void HarvestIO::writeFasta(std::ostream &out) const
-{
-	referenceList.writeToFasta(out);
-}
-
-void HarvestIO::writeHarvest(const char * file)
+bool HarvestIO::upgradeHarvest(const char * fileIn, const char * fileOut, BlockCodec codec, int level, bool packed)
 {
-	// use a pipe to compress Cap'n Proto output
+	// Sections are copied from the protocol buffer file to Cap'n Proto
+	// builders as they are read, in the same chunks writeHarvest uses, so
+	// only one chunk is held at a time and the lists are never built. Blocks
+	// are compressed on the calling thread so files can be upgraded in
+	// parallel.
 	
-	int fds[2];
-	int piped = pipe(fds);
+	ProtocolBufferReader reader;
 	
-	if ( piped < 0 )
+	if ( ! reader.open(fileIn) )
 	{
-		cerr << "ERROR: could not open pipe for compression\n";
-		exit(1);
+		cerr << "ERROR: could not open " << fileIn << " for reading.\n";
+		return false;
 	}
 	
-	int forked = fork();
+	int fd = open(fileOut, O_CREAT | O_WRONLY | O_TRUNC, 0644);
 	
-	if ( forked < 0 )
+	if ( fd < 0 )
 	{
-		cerr << "ERROR: could not fork for compression\n";
-		exit(1);
+		cerr << "ERROR: could not open " << fileOut << " for writing.\n";
+		return false;
 	}
 	
-	if ( forked == 0 )
+	BlockWriter writer(fd, codec, level, packed ? BLOCK_FLAG_packed : 0);
+	Harvest::AnnotationList msgAnnotations; // written last, after the references
+	bool annotations = false;
+	int field;
+	bool success = true;
+	
+	while ( success && reader.next(field) )
 	{
-		// read from pipe and write to compressed file
+		switch ( field )
+		{
+			case Harvest::kReferenceFieldNumber:
+				success = upgradeReference(reader, writer, packed);
+				break;
+			
+			case Harvest::kAnnotationsFieldNumber:
+				success = reader.read(&msgAnnotations);
+				annotations = true;
+				break;
+			
+			case Harvest::kTracksFieldNumber:
+			{
+				Harvest::TrackList msg;
+				
+				success = reader.read(&msg);
+				
+				if ( success )
+				{
+					capnp::MallocMessageBuilder message;
+					capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+					
+					upgradeTracks(msg, harvestBuilder);
+					writeHarvestSection(writer, SECTION_tracks, message, packed);
+				}
+				
+				break;
+			}
+			case Harvest::kTreeFieldNumber:
+			{
+				Harvest::Tree msg;
+				
+				success = reader.read(&msg);
+				
+				if ( success )
+				{
+					capnp::MallocMessageBuilder message;
+					capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+					
+					upgradeTree(msg, harvestBuilder);
+					writeHarvestSection(writer, SECTION_tree, message, packed);
+				}
+				
+				break;
+			}
+			case Harvest::kAlignmentFieldNumber:
+				success = upgradeAlignment(reader, writer, packed);
+				break;
+			
+			case Harvest::kVariationFieldNumber:
+				success = upgradeVariation(reader, writer, packed);
+				break;
+			
+			default:
+				success = reader.skip();
+		}
+	}
+	
+	success = success && ! reader.getFailed();
+	
+	if ( success && annotations )
+	{
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
 		
-		close(fds[1]); // other process's end of pipe
+		upgradeAnnotations(msgAnnotations, harvestBuilder);
+		writeHarvestSection(writer, SECTION_annotations, message, packed);
+	}
+	
+	writer.close();
+	close(fd);
+	
+	if ( ! success )
+	{
+		cerr << "ERROR: could not parse " << fileIn << ".\n";
+		unlink(fileOut);
+		return false;
+	}
+	
+	return true;
+}
+
+bool HarvestIO::upgradeAlignment(ProtocolBufferReader & reader, BlockWriter & writer, bool packed)
+{
+	// LCB messages are reused from chunk to chunk
+	
+	vector<Harvest::Alignment::Lcb> msgLcbs(lcbChunkSize);
+	int count = 0;
+	int field;
+	
+	if ( ! reader.enter() )
+	{
+		return false;
+	}
+	
+	while ( reader.next(field) )
+	{
+		if ( field != Harvest::Alignment::kLcbsFieldNumber )
+		{
+			if ( ! reader.skip() )
+			{
+				return false;
+			}
+			
+			continue;
+		}
 		
-		int fd = open(file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if ( ! reader.read(&msgLcbs[count]) )
+		{
+			return false;
+		}
 		
-		if ( fd < 0 )
+		count++;
+		
+		if ( count == lcbChunkSize )
 		{
-			cerr << "ERROR: could not open " << file << " for writing.\n";
-			exit(1);
+			capnp::MallocMessageBuilder message;
+			capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+			
+			upgradeLcbs(msgLcbs, count, harvestBuilder);
+			writeHarvestSection(writer, SECTION_lcbs, message, packed);
+			count = 0;
 		}
+	}
+	
+	if ( count )
+	{
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
 		
-		// write header
-		//
-		write(fd, capnpHeader, capnpHeaderLength);
-		//close(fd);
+		upgradeLcbs(msgLcbs, count, harvestBuilder);
+		writeHarvestSection(writer, SECTION_lcbs, message, packed);
+	}
+	
+	return ! reader.getFailed();
+}
+
+bool HarvestIO::upgradeReference(ProtocolBufferReader & reader, BlockWriter & writer, bool packed)
+{
+	// one reference per section, as in writeHarvest
+	
+	Harvest::Reference::Sequence msgSequence;
+	int field;
+	
+	if ( ! reader.enter() )
+	{
+		return false;
+	}
+	
+	while ( reader.next(field) )
+	{
+		if ( field != Harvest::Reference::kReferencesFieldNumber )
+		{
+			if ( ! reader.skip() )
+			{
+				return false;
+			}
+			
+			continue;
+		}
 		
-		int ret = def(fds[0], fd, Z_DEFAULT_COMPRESSION);
-		if (ret != Z_OK) zerr(ret);
-        exit(ret);
-        
-		char buffer[1024];
-		gzFile fileOut = gzopen(file, "ab");
+		if ( ! reader.read(&msgSequence) )
+		{
+			return false;
+		}
 		
-		int bytesRead;
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+		auto referenceBuilder = harvestBuilder.initReferenceList().initReferences(1)[0];
+		
+		referenceBuilder.setTag(msgSequence.tag());
+		referenceBuilder.setSequence(msgSequence.sequence());
+		writeHarvestSection(writer, SECTION_references, message, packed);
+	}
+	
+	return ! reader.getFailed();
+}
+
+bool HarvestIO::upgradeVariation(ProtocolBufferReader & reader, BlockWriter & writer, bool packed)
+{
+	// Every chunk carries the filters read so far; protocol buffer fields
+	// are written in order, so the filters all precede the variants.
+	// Variant messages are reused from chunk to chunk.
+	
+	vector<Harvest::Variation::Filter> msgFilters;
+	vector<Harvest::Variation::Variant> msgVariants(variantChunkSize);
+	int count = 0;
+	bool written = false;
+	int field;
+	
+	auto writeChunk = [&]()
+	{
+		uint64_t keyStart = count ? UINT64_MAX : 0;
+		uint64_t keyEnd = count ? 0 : UINT64_MAX;
 		
-		while ( (bytesRead = read(fds[0], buffer, sizeof(buffer))) > 0)
+		for ( int i = 0; i < count; i++ )
 		{
-			printf("compressing: %s\n", buffer);
-			gzwrite(fileOut, buffer, bytesRead);
+			uint64_t key = VariantList::getPositionKey(msgVariants[i].sequence(), msgVariants[i].position());
+			
+			keyStart = min(keyStart, key);
+			keyEnd = max(keyEnd, key);
 		}
 		
-		gzclose(fileOut);
-		close(fds[0]);
-		exit(0);
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+		
+		upgradeVariants(msgFilters, msgVariants, count, harvestBuilder);
+		writeHarvestSection(writer, SECTION_variants, message, packed, keyStart, keyEnd);
+		count = 0;
+		written = true;
+	};
+	
+	if ( ! reader.enter() )
+	{
+		return false;
+	}
+	
+	while ( reader.next(field) )
+	{
+		switch ( field )
+		{
+			case Harvest::Variation::kFiltersFieldNumber:
+				msgFilters.resize(msgFilters.size() + 1);
+				
+				if ( ! reader.read(&msgFilters[msgFilters.size() - 1]) )
+				{
+					return false;
+				}
+				
+				break;
+			
+			case Harvest::Variation::kVariantsFieldNumber:
+				if ( ! reader.read(&msgVariants[count]) )
+				{
+					return false;
+				}
+				
+				count++;
+				
+				if ( count == variantChunkSize )
+				{
+					writeChunk();
+				}
+				
+				break;
+			
+			default:
+				if ( ! reader.skip() )
+				{
+					return false;
+				}
+		}
+	}
+	
+	if ( count || (! written && msgFilters.size()) )
+	{
+		writeChunk();
+	}
+	
+	return ! reader.getFailed();
+}
+
+void HarvestIO::writeFasta(std::ostream &out) const
+{
+	referenceList.writeToFasta(out);
+}
+
+void HarvestIO::writeHarvest(const char * file, BlockCodec codec, int level, bool packed)
+{
+	int fd = open(file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	
+	if ( fd < 0 )
+	{
+		cerr << "ERROR: could not open " << file << " for writing.\n";
+		exit(1);
 	}
 	
-	// write to pipe
+	// blocks are compressed in parallel as the message is serialized
 	
-	close(fds[0]); // other process's end of pipe
-	/*
-	write(fds[1], "test\n", 5);
-	close(fds[1]);
-	return;
-	*/
+	ThreadPool pool(codec == CODEC_none ? 1 : 0);
+	BlockWriter writer(fd, codec, level, packed ? BLOCK_FLAG_packed : 0, codec == CODEC_none ? 0 : &pool);
 	
-	capnp::MallocMessageBuilder message;
-	capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+	// Each section is a separate message (with only its own field set) so
+	// it can be loaded without decompressing the others. Large sections are
+	// split into chunks, each built, serialized and freed in turn, so only
+	// one chunk is ever held in a builder alongside the lists themselves.
 	
-	if ( referenceList.getReferenceCount() )
+	for ( int i = 0; i < referenceList.getReferenceCount(); i++ )
 	{
-		referenceList.writeToCapnp(harvestBuilder);
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+		
+		referenceList.writeToCapnp(harvestBuilder, i, 1);
+		writeHarvestSection(writer, SECTION_references, message, packed);
 	}
 	
 	if ( annotationList.getAnnotationCount() )
 	{
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+		
 		annotationList.writeToCapnp(harvestBuilder, referenceList);
+		writeHarvestSection(writer, SECTION_annotations, message, packed);
 	}
 	
-	trackList.writeToCapnp(harvestBuilder);
+	{
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+		
+		trackList.writeToCapnp(harvestBuilder);
+		writeHarvestSection(writer, SECTION_tracks, message, packed);
+	}
 	
 	if ( phylogenyTree.getRoot() )
 	{
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+		
 		phylogenyTree.writeToCapnp(harvestBuilder);
+		writeHarvestSection(writer, SECTION_tree, message, packed);
 	}
 	
-	if ( lcbList.getLcbCount() )
+	for ( int i = 0; i < lcbList.getLcbCount(); i += lcbChunkSize )
 	{
-		lcbList.writeToCapnp(harvestBuilder);
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+		
+		lcbList.writeToCapnp(harvestBuilder, i, min(lcbChunkSize, lcbList.getLcbCount() - i));
+		writeHarvestSection(writer, SECTION_lcbs, message, packed);
 	}
 	
-	if ( variantList.getVariantCount() || variantList.getFilterCount() )
+	// Variant chunks also record the key range of their variants in the
+	// section table, so regions can be loaded without decompressing the
+	// rest. Every chunk carries the filters.
+	
+	for ( int i = 0; i < variantList.getVariantCount() || (i == 0 && variantList.getFilterCount()); i += variantChunkSize )
 	{
-		variantList.writeToCapnp(harvestBuilder);
+		int count = min(variantChunkSize, variantList.getVariantCount() - i);
+		uint64_t keyStart = count ? UINT64_MAX : 0;
+		uint64_t keyEnd = count ? 0 : UINT64_MAX;
+		
+		for ( int j = i; j < i + count; j++ )
+		{
+			const VariantList::Variant & variant = variantList.getVariant(j);
+			uint64_t key = VariantList::getPositionKey(variant.sequence, variant.position);
+			
+			keyStart = min(keyStart, key);
+			keyEnd = max(keyEnd, key);
+		}
+		
+		capnp::MallocMessageBuilder message;
+		capnp::Harvest::Builder harvestBuilder = message.initRoot<capnp::Harvest>();
+		
+		variantList.writeToCapnp(harvestBuilder, i, count);
+		writeHarvestSection(writer, SECTION_variants, message, packed, keyStart, keyEnd);
 	}
 	
-	//write(fds[1], capnpHeader, capnpHeaderLength);
-	
-	//write(fds[1], "hello", 5);
-	writeMessageToFd(fds[1], message);
-	
-//	FileOutputStream stream(fd);
-//	GzipOutputStream zip_stream(&stream);
+	writer.close();
+	close(fd);
+}
+
+void HarvestIO::writeHarvestSection(BlockWriter & writer, HarvestSection section, capnp::MessageBuilder & message, bool packed, uint64_t keyStart, uint64_t keyEnd)
+{
+	BlockOutputStream stream(writer);
 	
-//	if ( ! harvest.SerializeToZeroCopyStream(&zip_stream) )
-//	{
-//		printf("Failed to write.\n");
-//	}
+	writer.beginSection(section, keyStart, keyEnd);
 	
-//	zip_stream.Close();
-//	stream.Close();
-	close(fds[1]);
+	if ( packed )
+	{
+		capnp::writePackedMessage(stream, message);
+	}
+	else
+	{
+		capnp::writeMessage(stream, message);
+	}
 	
-//	harvest.Clear();
-//	google::protobuf::ShutdownProtobufLibrary();
+	writer.endSection();
 }
 
-void HarvestIO::writeMfa(std::ostream &out) const
+void HarvestIO::writeMfa(std::ostream &out, const FilterExpression * expression) const
 {
-	lcbList.writeToMfa(out, referenceList, trackList, variantList);
+	lcbList.writeToMfa(out, referenceList, trackList, variantList, expression);
 }
 
-void HarvestIO::writeFilteredMfa(std::ostream &out, std::ostream &out2) const
+void HarvestIO::writeFilteredMfa(std::ostream &out, std::ostream &out2, const FilterExpression * expression) const
 {
-        lcbList.writeFilteredToMfa(out, out2, referenceList, trackList, variantList);
+        lcbList.writeFilteredToMfa(out, out2, referenceList, trackList, variantList, expression);
 }
 
 void HarvestIO::writeNewick(std::ostream &out, bool useMult) const
@@ -426,9 +1271,9 @@ void HarvestIO::writeNewick(std::ostream &out, bool useMult) const
 	phylogenyTree.writeToNewick(out, trackList, useMult);
 }
 
-void HarvestIO::writeXmfa(std::ostream &out, bool split) const
+void HarvestIO::writeXmfa(std::ostream &out, bool split, const FilterExpression * expression) const
 {
-	lcbList.writeToXmfa(out, referenceList, trackList, variantList);
+	lcbList.writeToXmfa(out, referenceList, trackList, variantList, expression);
 }
 
 void HarvestIO::writeBackbone(std::ostream &out) const
@@ -484,12 +1329,12 @@ void HarvestIO::writeBackbone(std::ostream &out) const
 
 }
 
-void HarvestIO::writeSnp(std::ostream &out, bool indels) const
+void HarvestIO::writeSnp(std::ostream &out, bool indels, const FilterExpression * expression) const
 {
-	variantList.writeToMfa(out, indels, trackList);
+	variantList.writeToMfa(out, indels, trackList, expression);
 }
 
-void HarvestIO::writeVcf(std::ostream &out, const vector<string> * trackNames, const PhylogenyTreeNode * node, bool indels, bool signature) const
+void HarvestIO::writeVcf(std::ostream &out, const vector<string> * trackNames, const PhylogenyTreeNode * node, bool indels, bool signature, const FilterExpression * expression) const
 {
 	vector<int> tracks;
 	
@@ -521,7 +1366,7 @@ void HarvestIO::writeVcf(std::ostream &out, const vector<string> * trackNames, c
 		}
 	}
 	
-	variantList.writeToVcf(out, indels, referenceList, annotationList, trackList, tracks, signature);
+	variantList.writeToVcf(out, indels, referenceList, annotationList, trackList, tracks, signature, expression);
 }
 
 
@@ -8,6 +8,7 @@
 #define HarvestIO_h
 
 #include "harvest/pb/harvest.pb.h"
+#include <functional>
 #include <string>
 #include <map>
 #include <vector>
@@ -17,9 +18,28 @@
 #include "harvest/PhylogenyTree.h"
 #include "harvest/LcbList.h"
 #include "harvest/VariantList.h"
+#include "harvest/BlockIO.h"
 
-static const char * capnpHeader = "Cap'n Proto";
-static const int capnpHeaderLength = strlen(capnpHeader);
+class MappedFile;
+class ProtocolBufferReader;
+
+// Sections of a Gingr file, which can be loaded selectively.
+//
+enum HarvestSection
+{
+	SECTION_references = 1,
+	SECTION_annotations = 2,
+	SECTION_tracks = 4,
+	SECTION_tree = 8,
+	SECTION_lcbs = 16,
+	SECTION_variants = 32,
+	SECTION_all = 63,
+};
+
+// records per section when writing (references are one per section)
+//
+static const int lcbChunkSize = 1024;
+static const int variantChunkSize = 4096;
 
 class HarvestIO
 {
@@ -30,25 +50,31 @@ public:
 	void clear();
 	
 	void loadBed(const char * file, const char * name, const char * desc);
+	void loadBeds(const std::vector<VariantList::BedFilter> & beds); // sequences by reference name or 1-based index
 	void loadFasta(const char * file);
+	bool loadFilterCounts(const char * file, std::vector<uint64_t> & counts); // without loading variants; false if they must be
 	void loadGenbank(const char * file, bool useSeq);
-	bool loadHarvest(const char * file);
-	bool loadHarvestCapnp(const char * file);
+	bool loadHarvest(const char * file, int sections = SECTION_all); // protocol buffer files are always loaded whole
+	bool loadHarvestBlocks(const char * file, int sections = SECTION_all, uint64_t keyStart = 0, uint64_t keyEnd = UINT64_MAX);
+	bool loadHarvestCapnp(const char * file, int sections = SECTION_all);
 	bool loadHarvestProtocolBuffer(const char * file);
 	void loadMaf(const char * file, bool findVariants, const char * referenceFileName);
 	void loadMfa(const char * file, bool findVariants);
 	void loadNewick(const char * file);
 	void loadVcf(const char * file);
+	bool loadVariantsInRange(const char * file, int sequence, int start, int end); // 0-based, inclusive
 	void loadXmfa(const char * file, bool findVariants);
 	
+	static bool upgradeHarvest(const char * fileIn, const char * fileOut, BlockCodec codec = CODEC_zlib, int level = blockLevelDefault, bool packed = false); // protocol buffer to blocks, without loading
+	
 	void writeFasta(std::ostream &out) const;
-	void writeHarvest(const char * file);
-	void writeMfa(std::ostream &out) const;
-	void writeFilteredMfa(std::ostream &out, std::ostream &out2) const;
+	void writeHarvest(const char * file, BlockCodec codec = CODEC_zlib, int level = blockLevelDefault, bool packed = false);
+	void writeMfa(std::ostream &out, const FilterExpression * expression = 0) const;
+	void writeFilteredMfa(std::ostream &out, std::ostream &out2, const FilterExpression * expression = 0) const;
 	void writeNewick(std::ostream &out, bool useMult = false) const;
-	void writeSnp(std::ostream &out, bool indels = false) const;
-	void writeVcf(std::ostream &out, const std::vector<std::string> * trackNames = 0, const PhylogenyTreeNode * node = 0, bool indels = false, bool signature = false) const;
-	void writeXmfa(std::ostream &out, bool split = false) const;
+	void writeSnp(std::ostream &out, bool indels = false, const FilterExpression * expression = 0) const;
+	void writeVcf(std::ostream &out, const std::vector<std::string> * trackNames = 0, const PhylogenyTreeNode * node = 0, bool indels = false, bool signature = false, const FilterExpression * expression = 0) const;
+	void writeXmfa(std::ostream &out, bool split = false, const FilterExpression * expression = 0) const;
 	void writeBackbone(std::ostream &out) const;
 	
 	ReferenceList referenceList;
@@ -60,7 +86,16 @@ public:
 	
 private:
 	
+	void initFromCapnp(const capnp::Harvest::Reader & harvestReader, int sections, int sectionsAppend);
+	bool loadVariationProtocolBuffer(ProtocolBufferReader & reader, google::protobuf::Arena & arena);
+	bool loadHarvestSection(const char * file, const BlockReader & reader, const MappedFile & mappedFile, ThreadPool & pool, int blockStart, int blockCount, int sections, int sectionsAppend);
+	bool readHarvestSection(const char * file, const BlockReader & reader, const MappedFile & mappedFile, ThreadPool & pool, int blockStart, int blockCount, const std::function<bool(const capnp::Harvest::Reader &)> & init);
 	void writeNewickNode(std::ostream &out, const Harvest::Tree::Node & msg) const;
+	
+	static bool upgradeAlignment(ProtocolBufferReader & reader, BlockWriter & writer, bool packed);
+	static bool upgradeReference(ProtocolBufferReader & reader, BlockWriter & writer, bool packed);
+	static bool upgradeVariation(ProtocolBufferReader & reader, BlockWriter & writer, bool packed);
+	static void writeHarvestSection(BlockWriter & writer, HarvestSection section, capnp::MessageBuilder & message, bool packed, uint64_t keyStart = 0, uint64_t keyEnd = UINT64_MAX);
 };
 
 int def(int fdSource, int fdDest, int level);
@@ -0,0 +1,460 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "harvest/InputStream.h"
+
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace::std;
+
+static const size_t inputChunk = 1 << 20;
+static const size_t outputChunk = 1 << 18;
+static const int bgzfHeaderLength = 18; // with only the BC subfield
+static const uint32_t bgzfBlockSizeMax = 65536; // inflated
+static const int bgzfReadAheadPerThread = 8;
+
+static int getUint16(const char * src)
+{
+	return (unsigned char)src[0] | (unsigned char)src[1] << 8;
+}
+
+static uint32_t getUint32(const char * src)
+{
+	uint32_t value = 0;
+	
+	for ( int i = 0; i < 4; i++ )
+	{
+		value |= (uint32_t)(unsigned char)src[i] << (8 * i);
+	}
+	
+	return value;
+}
+
+// inflates a whole BGZF block (a gzip member with a raw deflate payload)
+//
+static bool inflateBgzfBlock(const string & block, string & data)
+{
+	int payloadStart = 12 + getUint16(&block[10]);
+	
+	if ( payloadStart + 8 > block.length() )
+	{
+		return false;
+	}
+	
+	uint32_t crc = getUint32(&block[block.length() - 8]);
+	uint32_t size = getUint32(&block[block.length() - 4]);
+	
+	if ( size > bgzfBlockSizeMax )
+	{
+		return false;
+	}
+	
+	z_stream stream = z_stream();
+	
+	if ( inflateInit2(&stream, -15) != Z_OK )
+	{
+		return false;
+	}
+	
+	data.resize(size);
+	
+	stream.next_in = (Bytef *)&block[payloadStart];
+	stream.avail_in = block.length() - payloadStart - 8;
+	stream.next_out = (Bytef *)&data[0];
+	stream.avail_out = size;
+	
+	int result = inflate(&stream, Z_FINISH);
+	
+	inflateEnd(&stream);
+	
+	return result == Z_STREAM_END && stream.total_out == size && crc32(0, (const Bytef *)data.data(), size) == crc;
+}
+
+InputStream::InputStream(const char * file, ThreadPool * pool)
+	: istream(0)
+{
+	rdbuf(&buffer);
+	
+	if ( file )
+	{
+		open(file, pool);
+	}
+}
+
+void InputStream::close()
+{
+	buffer.close();
+}
+
+bool InputStream::open(const char * file, ThreadPool * pool)
+{
+	if ( buffer.open(file, pool) )
+	{
+		clear();
+		return true;
+	}
+	
+	setstate(failbit);
+	return false;
+}
+
+InputStream::Buffer::Buffer()
+{
+	fd = -1;
+	format = FORMAT_plain;
+	failed = false;
+	inputPosition = 0;
+	stream = 0;
+	pool = 0;
+}
+
+InputStream::Buffer::~Buffer()
+{
+	close();
+}
+
+void InputStream::Buffer::close()
+{
+	if ( fd >= 0 )
+	{
+		::close(fd);
+		fd = -1;
+	}
+	
+	if ( stream )
+	{
+		inflateEnd(stream);
+		delete stream;
+		stream = 0;
+	}
+	
+	pending.clear();
+	pool = 0;
+	poolOwned.reset();
+	input.clear();
+	output.clear();
+	setg(0, 0, 0);
+}
+
+bool InputStream::Buffer::fail()
+{
+	if ( ! failed )
+	{
+		cerr << "ERROR: " << file << " is corrupt or truncated." << endl;
+		failed = true;
+	}
+	
+	return false;
+}
+
+bool InputStream::Buffer::fillInput(size_t size)
+{
+	// makes at least size bytes available from inputPosition, unless the file
+	// ends first
+	
+	if ( input.length() - inputPosition >= size )
+	{
+		return true;
+	}
+	
+	if ( inputPosition )
+	{
+		input.erase(0, inputPosition);
+		inputPosition = 0;
+	}
+	
+	while ( input.length() < size )
+	{
+		size_t length = input.length();
+		
+		input.resize(length + inputChunk);
+		
+		ssize_t bytes = ::read(fd, &input[length], inputChunk);
+		
+		input.resize(length + (bytes > 0 ? bytes : 0));
+		
+		if ( bytes <= 0 )
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool InputStream::Buffer::open(const char * fileNew, ThreadPool * poolNew)
+{
+	close();
+	
+	fd = ::open(fileNew, O_RDONLY);
+	
+	if ( fd < 0 )
+	{
+		return false;
+	}
+	
+	file = fileNew;
+	failed = false;
+	inputPosition = 0;
+	
+	fillInput(bgzfHeaderLength);
+	
+	const char * magic = input.data();
+	
+	if ( input.length() >= 2 && magic[0] == '\x1f' && magic[1] == '\x8b' )
+	{
+		if ( readBlockLength() )
+		{
+			format = FORMAT_bgzf;
+			pool = poolNew;
+			
+			if ( ! pool )
+			{
+				poolOwned.reset(new ThreadPool());
+				pool = poolOwned.get();
+			}
+			
+			blocksEnd = false;
+			blocksCorrupt = false;
+		}
+		else
+		{
+			format = FORMAT_gzip;
+			stream = new z_stream();
+			streamEnd = false;
+			
+			if ( inflateInit2(stream, 15 + 16) != Z_OK )
+			{
+				delete stream;
+				stream = 0;
+				close();
+				return false;
+			}
+		}
+	}
+	else
+	{
+		format = FORMAT_plain;
+	}
+	
+	return true;
+}
+
+bool InputStream::Buffer::readBlock()
+{
+	// reads the next BGZF block and queues it to be inflated; blocks queued
+	// before a bad one are still used
+	
+	if ( ! fillInput(bgzfHeaderLength) )
+	{
+		blocksCorrupt = inputPosition < input.length();
+		return false;
+	}
+	
+	size_t blockLength = readBlockLength();
+	
+	if ( blockLength == 0 || ! fillInput(blockLength) )
+	{
+		blocksCorrupt = true;
+		return false;
+	}
+	
+	shared_ptr<string> block(new string(input, inputPosition, blockLength));
+	
+	inputPosition += blockLength;
+	
+	pending.push_back(pool->submit([block]()
+	{
+		shared_ptr<string> data(new string());
+		
+		if ( ! inflateBgzfBlock(*block, *data) )
+		{
+			data.reset();
+		}
+		
+		return data;
+	}));
+	
+	return true;
+}
+
+size_t InputStream::Buffer::readBlockLength()
+{
+	// BSIZE is in the BC subfield, which need not be the only or first one
+	
+	if ( ! fillInput(12) )
+	{
+		return 0;
+	}
+	
+	const char * header = input.data() + inputPosition;
+	
+	if ( header[0] != '\x1f' || header[1] != '\x8b' || ! (header[3] & 4) )
+	{
+		return 0;
+	}
+	
+	size_t headerLength = 12 + getUint16(header + 10);
+	
+	if ( ! fillInput(headerLength) )
+	{
+		return 0;
+	}
+	
+	header = input.data() + inputPosition;
+	
+	for ( size_t i = 12; i + 4 <= headerLength; )
+	{
+		size_t subfieldLength = getUint16(header + i + 2);
+		
+		if ( header[i] == 'B' && header[i + 1] == 'C' && subfieldLength == 2 && i + 6 <= headerLength )
+		{
+			size_t blockLength = getUint16(header + i + 4) + 1;
+			
+			return blockLength >= headerLength + 8 ? blockLength : 0;
+		}
+		
+		i += 4 + subfieldLength;
+	}
+	
+	return 0;
+}
+
+InputStream::Buffer::int_type InputStream::Buffer::underflow()
+{
+	if ( gptr() < egptr() )
+	{
+		return traits_type::to_int_type(*gptr());
+	}
+	
+	if ( fd < 0 || failed )
+	{
+		return traits_type::eof();
+	}
+	
+	switch ( format )
+	{
+		case FORMAT_plain:
+		{
+			if ( inputPosition == input.length() && ! fillInput(1) )
+			{
+				return traits_type::eof();
+			}
+			
+			output.swap(input);
+			input.clear();
+			
+			char * start = &output[inputPosition];
+			
+			setg(start, start, &output[0] + output.length());
+			inputPosition = 0;
+			break;
+		}
+		
+		case FORMAT_gzip:
+		{
+			output.resize(outputChunk);
+			
+			while ( true )
+			{
+				if ( inputPosition == input.length() && ! fillInput(1) )
+				{
+					if ( ! streamEnd )
+					{
+						fail();
+					}
+					
+					return traits_type::eof();
+				}
+				
+				if ( streamEnd )
+				{
+					// concatenated member
+					
+					inflateReset(stream);
+					streamEnd = false;
+				}
+				
+				stream->next_in = (Bytef *)&input[inputPosition];
+				stream->avail_in = input.length() - inputPosition;
+				stream->next_out = (Bytef *)&output[0];
+				stream->avail_out = outputChunk;
+				
+				int result = inflate(stream, Z_NO_FLUSH);
+				
+				inputPosition = input.length() - stream->avail_in;
+				
+				if ( result == Z_STREAM_END )
+				{
+					streamEnd = true;
+				}
+				else if ( result != Z_OK )
+				{
+					fail();
+					return traits_type::eof();
+				}
+				
+				if ( stream->avail_out < outputChunk )
+				{
+					setg(&output[0], &output[0], &output[0] + outputChunk - stream->avail_out);
+					break;
+				}
+			}
+			
+			break;
+		}
+		
+		case FORMAT_bgzf:
+		{
+			while ( true )
+			{
+				while ( ! blocksEnd && pending.size() < bgzfReadAheadPerThread * pool->getThreadCount() )
+				{
+					if ( ! readBlock() )
+					{
+						blocksEnd = true;
+					}
+				}
+				
+				if ( pending.size() == 0 )
+				{
+					if ( blocksCorrupt )
+					{
+						fail();
+					}
+					
+					return traits_type::eof();
+				}
+				
+				shared_ptr<string> data = pending.front().get();
+				
+				pending.pop_front();
+				
+				if ( ! data )
+				{
+					fail();
+					return traits_type::eof();
+				}
+				
+				if ( data->length() )
+				{
+					// empty blocks (such as the end marker) are skipped
+					
+					output.swap(*data);
+					setg(&output[0], &output[0], &output[0] + output.length());
+					break;
+				}
+			}
+			
+			break;
+		}
+	}
+	
+	return traits_type::to_int_type(*gptr());
+}
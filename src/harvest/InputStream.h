@@ -0,0 +1,99 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef InputStream_h
+#define InputStream_h
+
+#include <deque>
+#include <future>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+
+#include "harvest/ThreadPool.h"
+
+struct z_stream_s;
+
+// Input file stream for the text loaders that reads plain, gzip or BGZF
+// (bgzip) files, told apart by their first bytes. BGZF blocks are
+// independent gzip members, so several are read ahead and inflated in
+// parallel; other gzip files (including concatenated members) are inflated
+// as they are read. A corrupt or truncated file ends the stream early with an
+// error on cerr.
+
+class InputStream : public std::istream
+{
+public:
+
+	InputStream(const char * file = 0, ThreadPool * pool = 0); // BGZF blocks are inflated on the pool, or on one of the stream's own
+	
+	void close();
+	bool is_open() const;
+	bool open(const char * file, ThreadPool * pool = 0);
+
+private:
+
+	class Buffer : public std::streambuf
+	{
+	public:
+	
+		Buffer();
+		~Buffer();
+		
+		void close();
+		bool isOpen() const;
+		bool open(const char * file, ThreadPool * poolNew);
+	
+	protected:
+	
+		int_type underflow();
+	
+	private:
+	
+		enum Format
+		{
+			FORMAT_plain,
+			FORMAT_gzip,
+			FORMAT_bgzf,
+		};
+		
+		bool fail();
+		bool fillInput(size_t size);
+		bool readBlock();
+		size_t readBlockLength(); // of the BGZF block at inputPosition, or 0 if it is not one
+		
+		std::string file;
+		int fd;
+		Format format;
+		bool failed;
+		
+		std::string input; // read from the file, from inputPosition on unused
+		size_t inputPosition;
+		
+		std::string output;
+		
+		// gzip
+		//
+		z_stream_s * stream;
+		bool streamEnd; // between members
+		
+		// BGZF
+		//
+		ThreadPool * pool;
+		std::unique_ptr<ThreadPool> poolOwned; // if none was given
+		std::deque<std::future<std::shared_ptr<std::string> > > pending; // inflated blocks in order, or null if corrupt
+		bool blocksEnd;
+		bool blocksCorrupt;
+	};
+	
+	Buffer buffer;
+};
+
+inline bool InputStream::is_open() const { return buffer.isOpen(); }
+inline bool InputStream::Buffer::isOpen() const { return fd >= 0; }
+
+#endif
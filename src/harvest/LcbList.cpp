@@ -6,15 +6,19 @@
 
 #include "harvest/LcbList.h"
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include "harvest/InputStream.h"
 #include "harvest/parse.h"
+#include "harvest/MappedFile.h"
+#include <deque>
+#include <future>
+#include <memory>
 #include <set>
 #include <stdlib.h>
+#include <string.h>
 #include "harvest/exceptions.h"
 #include "harvest/VariantList.h"
+#include "harvest/FilterExpression.h"
 #include <algorithm>
-#include <limits>
 
 using namespace::std;
 
@@ -96,16 +100,17 @@ void LcbList::clear()
 	lcbs.clear();
 }
 
-void LcbList::initFromCapnp(const capnp::Harvest::Reader & harvestReader)
+void LcbList::initFromCapnp(const capnp::Harvest::Reader & harvestReader, bool append)
 {
 	auto lcbListReader = harvestReader.getLcbList();
 	auto lcbsReader = lcbListReader.getLcbs();
+	int start = append ? lcbs.size() : 0;
 	
-	lcbs.resize(lcbsReader.size());
+	lcbs.resize(start + lcbsReader.size());
 	
 	for ( int i = 0; i < lcbsReader.size(); i++ )
 	{
-		Lcb & lcb = lcbs[i];
+		Lcb & lcb = lcbs[start + i];
 		auto lcbReader = lcbsReader[i];
 		
 		lcb.sequence = lcbReader.getSequence();
@@ -130,45 +135,183 @@ void LcbList::initFromCapnp(const capnp::Harvest::Reader & harvestReader)
 	}
 }
 
-void LcbList::initFromMaf(const char * file, ReferenceList * referenceList, TrackList * trackList, PhylogenyTree * phylogenyTree, VariantList * variantList, const char * referenceFileName)
+// MAF files are split into chunks of whole alignment blocks, which are
+// parsed on a thread pool and merged in order (see LcbList::initFromMaf).
+//
+static const int mafChunkSize = 1 << 22; // bytes read at a time
+static const int mafReadAheadPerThread = 2;
+
+struct MafRow
 {
-	lcbs.resize(0);
+	string track;
+	string sequence;
+	int position; // forward strand
+	int length;
+	bool reverse;
+	int sequenceLength;
+	const char * seq; // in the chunk text
+	int columns;
+};
+
+struct MafBlock
+{
+	vector<MafRow> rows; // "s" lines
+	int ungappedRow; // row whose sequence is in ungapped, or -1
+	string ungapped; // forward strand
+};
+
+struct MafChunk
+{
+	string text; // lines are terminated in place
+	vector<MafBlock> blocks;
+};
+
+static void parseMafChunk(MafChunk & chunk, bool ungap, const string & referenceTrack)
+{
+	// Finds the "s" lines of each block and parses their fields. If asked,
+	// the row of the reference track (or the first row, if it's not known
+	// yet) is ungapped, since that will usually be the reference row.
 	
-	ifstream in(file);
-	string line;
-	int trackCount = 0;
+	char * data = &chunk.text[0];
+	char * dataEnd = data + chunk.text.length();
+	bool inBlock = false;
+	
+	auto finishBlock = [&]()
+	{
+		MafBlock & block = chunk.blocks.back();
+		
+		for ( int i = 0; ungap && i < block.rows.size(); i++ )
+		{
+			const MafRow & row = block.rows[i];
+			
+			if ( referenceTrack.length() == 0 || row.track == referenceTrack )
+			{
+				block.ungappedRow = i;
+				block.ungapped.assign(row.seq, row.columns);
+				::ungap(block.ungapped);
+				
+				if ( row.reverse )
+				{
+					reverseComplement(block.ungapped);
+				}
+				
+				break;
+			}
+		}
+		
+		inBlock = false;
+	};
+	
+	while ( data < dataEnd )
+	{
+		char * line = data;
+		char * lineEnd = (char *)memchr(data, '\n', dataEnd - data);
+		
+		if ( lineEnd )
+		{
+			*lineEnd = 0;
+			data = lineEnd + 1;
+		}
+		else
+		{
+			data = dataEnd;
+		}
+		
+		if ( line[0] == 's' && inBlock )
+		{
+			MafBlock & block = chunk.blocks.back();
+			
+			block.rows.resize(block.rows.size() + 1);
+			
+			MafRow & row = block.rows.back();
+			char * field = line + 2;
+			int nameLength = strcspn(field, ".");
+			
+			row.track.assign(field, nameLength);
+			field += nameLength;
+			
+			if ( *field == '.' )
+			{
+				field++;
+			}
+			
+			int seqNameLength = strcspn(field, " \t");
+			char * end;
+			
+			row.sequence.assign(field, seqNameLength);
+			row.position = strtol(field + seqNameLength, &end, 10);
+			row.length = strtol(end, &end, 10);
+			
+			end += strspn(end, " \t");
+			
+			row.reverse = *end == '-';
+			row.sequenceLength = strtol(end + 1, &end, 10);
+			
+			if ( row.reverse )
+			{
+				row.position = row.sequenceLength - row.position - row.length; // MAF is stupid
+			}
+			
+			row.seq = end + strspn(end, " \t");
+			row.columns = strcspn(row.seq, " \t\r");
+			continue;
+		}
+		
+		if ( inBlock && ( line[0] == 0 || line[0] == 'a' ) )
+		{
+			finishBlock();
+		}
+		
+		if ( line[0] == 'a' )
+		{
+			chunk.blocks.resize(chunk.blocks.size() + 1);
+			chunk.blocks.back().ungappedRow = -1;
+			inBlock = true;
+		}
+	}
+	
+	if ( inBlock )
+	{
+		finishBlock();
+	}
+}
+
+void LcbList::initFromMaf(const char * file, ReferenceList * referenceList, TrackList * trackList, PhylogenyTree * phylogenyTree, VariantList * variantList, const char * referenceFileName)
+{
+	// The file is read in large pieces and split before its last "a" line,
+	// so each chunk holds whole alignment blocks. Worker threads split the
+	// chunks into lines, parse the "s" lines and ungap reference rows. The
+	// chunks are then merged in file order on this thread, which checks for
+	// core blocks, names tracks and references, rejects overlapping LCBs and
+	// hands the rows to the variant caller, so the result does not depend on
+	// the number of threads. Inflating, parsing and calling share one pool, so
+	// -t caps the threads used.
+	
+	ThreadPool pool;
+	InputStream in(file, &pool);
+	int trackCount;
 	vector<string> seqs;
 	const bool oldTags = phylogenyTree->getRoot();
 	int * trackIndecesNew;
-	bool mauve = false;
 	vector<string> refs;
 	vector<string> refNames;
 	map<string, int> refIndexByName;
 	vector<map<string, int> > regionOffsetBySeqNameByTrack;
 	vector<int> totalOffsetByTrack;
+	string referenceTrack;
 	
 	set<Interval> lcbIntervals;
 	
 	bool createReference = referenceList->getReferenceCount() == 0;
-	
-	if ( variantList )
-	{
-		variantList->init();
-	}
+	unique_ptr<VariantList::AlignmentCaller> caller;
 	
 	if ( oldTags )
 	{
 		trackIndecesNew = new int[trackList->getTrackCount()];
 	}
-	else
-	{
-		trackList->clear();
-	}
 	
 	if ( referenceFileName )
 	{
-		char referenceBaseName[strlen(referenceFileName)];
-		
 		for ( const char * i = referenceFileName; *i != 0; i++ )
 		{
 			if ( *i == '/' )
@@ -177,133 +320,50 @@ void LcbList::initFromMaf(const char * file, ReferenceList * referenceList, Trac
 			}
 		}
 		
-		strcpy(referenceBaseName, referenceFileName);
-		strtok(referenceBaseName, ".");
-		
-		int trackIndex;
-		
-		try
-		{
-			trackIndex = trackList->getTrackIndexByFile(referenceBaseName);
-		}
-		catch ( const TrackList::TrackNotFoundException & e )
-		{
-			if ( oldTags )
-			{
-				delete [] trackIndecesNew;
-				throw;
-			}
-			else
-			{
-				trackIndex = trackList->addTrack(referenceBaseName);
-			}
-		}
-		
-		if ( oldTags )
-		{
-			trackIndecesNew[trackIndex] = trackCount;
-			trackCount++;
-		}
-		
+		referenceTrack = string(referenceFileName, strcspn(referenceFileName, "."));
 	}
 	
-	LcbList::Lcb * lcb = 0;
-	bool lcbReverse;
-	
-	TrackList::Track * track;
-	char * suffix;
 	int queryCount = 0;
-	int lcbQueryCount = 0;
-	vector<int> queryCountsByLcb;
 	set<string> seqNames;
 	
-	// scan through once to determine number of query sequences...
-	
-	if ( ! in.is_open() )
-	{
-		cerr << "ERROR: " << file << " could not be opened.";
-		return;
-	}
-	
-	while ( getline(in, line) )
+	// Blocks are only core if they have every query sequence in the file, but
+	// the file is read once, so a block is taken as core if it has every
+	// query seen so far. If a new query appears, none of the blocks taken so
+	// far were core, and everything is started over.
+	//
+	auto restart = [&]()
 	{
-		if ( line[0] == 's' )
+		lcbs.resize(0);
+		lcbIntervals.clear();
+		refs.resize(0);
+		refNames.resize(0);
+		refIndexByName.clear();
+		regionOffsetBySeqNameByTrack.assign(queryCount, map<string, int>());
+		totalOffsetByTrack.assign(queryCount, 0);
+		trackCount = 0;
+		
+		if ( caller )
 		{
-			stringstream lineStream(line);
-			
-			lineStream.ignore(2);
-			
-			string trackName;
-			getline(lineStream, trackName, '.');
-			seqNames.insert(trackName);
-			
-			lcbQueryCount++;
+			caller->finish();
 		}
-		else if ( line[0] == 0 )
+		
+		if ( variantList )
 		{
-			queryCountsByLcb.push_back(lcbQueryCount);
-			lcbQueryCount = 0;
+			variantList->init();
 		}
-	}
-	
-	queryCount = seqNames.size();
-	regionOffsetBySeqNameByTrack.resize(queryCount);
-	totalOffsetByTrack.resize(queryCount, 0);
-	
-	// ...now parse only those that are core
-	
-	in.clear();
-	in.seekg(0);
-	int lcbIndex = 0;
-	
-	while ( getline(in, line) )
-	{
-		if ( line[0] == 'a' )
+		
+		if ( ! oldTags )
 		{
-			// new alignment block; first check if it's core
-			
-			if ( queryCountsByLcb[lcbIndex] == queryCount )
-			{
-				// core; create a new Lcb
-				
-				if ( variantList && lcbs.size() == 0 )
-				{
-					seqs.resize(queryCount);
-				}
-			
-				lcbs.resize(lcbs.size() + 1);
-				lcb = &lcbs[lcbs.size() - 1];
-			}
-			else
-			{
-				// not core; eat it
-				
-				while ( in.peek() != '\n' )
-				{
-					in.ignore(numeric_limits<streamsize>::max(), '\n');
-				}
-				
-				lcb = 0;
-			}
-			
-			lcbIndex++;
+			trackList->clear();
 		}
-		else if ( line[0] == 's' )
+		
+		if ( referenceFileName )
 		{
-			stringstream lineStream(line);
-			
-			lineStream.ignore(2);
-			
-			string trackName;
-			getline(lineStream, trackName, '.');
-			
 			int trackIndex;
 			
-			// create track if name is new
-			
 			try
 			{
-				trackIndex = trackList->getTrackIndexByFile(trackName);
+				trackIndex = trackList->getTrackIndexByFile(referenceTrack);
 			}
 			catch ( const TrackList::TrackNotFoundException & e )
 			{
@@ -311,221 +371,351 @@ void LcbList::initFromMaf(const char * file, ReferenceList * referenceList, Trac
 				{
 					delete [] trackIndecesNew;
 					throw;
-					return;
 				}
 				else
 				{
-					trackIndex = trackList->addTrack(trackName);
+					trackIndex = trackList->addTrack(referenceTrack);
 				}
 			}
 			
-			if ( oldTags && trackCount < trackList->getTrackCount() )
+			if ( oldTags )
 			{
 				trackIndecesNew[trackIndex] = trackCount;
 				trackCount++;
 			}
+		}
+	};
+	
+	restart();
+	
+	if ( variantList )
+	{
+		caller.reset(new VariantList::AlignmentCaller(*variantList, *referenceList, &pool));
+	}
+	
+	if ( ! in.is_open() )
+	{
+		cerr << "ERROR: " << file << " could not be opened.";
+		return;
+	}
+	
+	vector<const char *> rows; // sequences in the block, by track
+	vector<int> rowLengths;
+	
+	auto merge = [&](const shared_ptr<MafChunk> & chunk)
+	{
+		for ( int i = 0; i < chunk->blocks.size(); i++ )
+		{
+			const MafBlock & block = chunk->blocks[i];
+			int blockLines = block.rows.size();
+			LcbList::Lcb * lcb = 0;
+			bool lcbReverse;
+			TrackList::Track * track;
 			
-			track = &trackList->getTrackMutable(trackIndex);
-			
-			// basename parsing; not sure if this is needed for MAF
-			//
-/*					char * name = suffix;
-			
-			for ( int i = 0; i < strlen(suffix) - 1; i++ )
+			for ( int j = 0; j < blockLines; j++ )
 			{
-				if ( suffix[i] == '/' )
-				{
-					name = suffix + i + 1;
-				}
+				seqNames.insert(block.rows[j].track);
 			}
-*/					
-			track->file = trackName;
 			
-			// parse positional info
+			// parse the block if it's core
 			
-			string seqName;
-			lineStream >> seqName;
+			if ( seqNames.size() != queryCount )
+			{
+				queryCount = seqNames.size();
+				restart();
+			}
 			
-			if ( trackIndex >= lcb->regions.size() )
+			if ( blockLines == queryCount )
 			{
-				int sizeOld = lcb->regions.size();
-				lcb->regions.resize(trackIndex + 1);
+				lcbs.resize(lcbs.size() + 1);
+				lcb = &lcbs[lcbs.size() - 1];
 				
-				for ( int i = sizeOld; i < trackIndex; i++ )
+				if ( variantList )
 				{
-					lcb->regions[i].position = 0;
-					lcb->regions[i].length = 0;
-					lcb->regions[i].reverse = false;
+					seqs.resize(queryCount);
+					rows.assign(queryCount, 0);
+					rowLengths.assign(queryCount, 0);
 				}
 			}
 			
-			int position;
-			int length;
-			char reverseChar;
-			int seqLength;
-			
-			lineStream >> position >> length >> reverseChar >> seqLength;
-			
-			bool reverse = reverseChar == '-';
-			
-			if ( reverse )
+			for ( int j = 0; lcb && j < blockLines; j++ )
 			{
-				position = seqLength - position - length; // MAF is stupid
-			}
-			
-			if ( regionOffsetBySeqNameByTrack[trackIndex].count(seqName) == 0 )
-			{
-				// new sequence for this track; it's offset is the current total
+				const MafRow & row = block.rows[j];
+				int trackIndex;
 				
-				regionOffsetBySeqNameByTrack[trackIndex][seqName] = totalOffsetByTrack[trackIndex];
-				totalOffsetByTrack[trackIndex] += seqLength;
-			}
-			
-			int refIndex;
-			
-			if ( trackIndex == 0 )
-			{
-				// translate ref seq name to index and create if needed
+				// create track if name is new
 				
 				try
 				{
-					// check our local cache of names
+					trackIndex = trackList->getTrackIndexByFile(row.track);
+				}
+				catch ( const TrackList::TrackNotFoundException & e )
+				{
+					if ( oldTags )
+					{
+						delete [] trackIndecesNew;
+						throw;
+					}
+					else
+					{
+						trackIndex = trackList->addTrack(row.track);
+					}
+				}
+				
+				if ( oldTags && trackCount < trackList->getTrackCount() )
+				{
+					trackIndecesNew[trackIndex] = trackCount;
+					trackCount++;
+				}
+				
+				track = &trackList->getTrackMutable(trackIndex);
+				track->file = row.track;
+				
+				if ( trackIndex >= lcb->regions.size() )
+				{
+					int sizeOld = lcb->regions.size();
+					lcb->regions.resize(trackIndex + 1);
 					
-					refIndex = refIndexByName.at(seqName);
+					for ( int k = sizeOld; k < trackIndex; k++ )
+					{
+						lcb->regions[k].position = 0;
+						lcb->regions[k].length = 0;
+						lcb->regions[k].reverse = false;
+					}
 				}
-				catch ( const out_of_range & e )
+				
+				if ( regionOffsetBySeqNameByTrack[trackIndex].count(row.sequence) == 0 )
 				{
-					// not in local cache of names
+					// new sequence for this track; it's offset is the current total
 					
-					if ( createReference )
+					regionOffsetBySeqNameByTrack[trackIndex][row.sequence] = totalOffsetByTrack[trackIndex];
+					totalOffsetByTrack[trackIndex] += row.sequenceLength;
+				}
+				
+				int refIndex;
+				
+				if ( trackIndex == 0 )
+				{
+					// translate ref seq name to index and create if needed
+					
+					try
 					{
-						// create ref and cache its index
-						
-						refIndex = refs.size();
-						refs.resize(refs.size() + 1);
-						refNames.resize(refNames.size() + 1);
-						refNames[refIndex] = seqName;
-						refs[refIndex].resize(seqLength, 'N');
+						// check our local cache of names
 						
-						refIndexByName[seqName] = refIndex;
+						refIndex = refIndexByName.at(row.sequence);
 					}
-					else
+					catch ( const out_of_range & e )
 					{
-						// reference should already exist
+						// not in local cache of names
 						
-						try
+						if ( createReference )
 						{
-							refIndex = referenceList->getReferenceSequenceFromName(seqName);
+							// create ref and cache its index
+							
+							refIndex = refs.size();
+							refs.resize(refs.size() + 1);
+							refNames.resize(refNames.size() + 1);
+							refNames[refIndex] = row.sequence;
+							refs[refIndex].resize(row.sequenceLength, 'N');
+							
+							refIndexByName[row.sequence] = refIndex;
 						}
-						catch ( ReferenceList::NameNotFoundException & e )
+						else
 						{
-							// reference doesn't exist; error
-							throw;
+							// reference should already exist
+							
+							refIndex = referenceList->getReferenceSequenceFromName(row.sequence);
+							
+							// cache for faster lookup next time
+							
+							refIndexByName[row.sequence] = refIndex;
 						}
-						
-						// cache for faster lookup next time
-						
-						refIndexByName[seqName] = refIndex;
-					}
-				}
-				
-				set<Interval>::iterator lowerBound = lcbIntervals.lower_bound(Interval(refIndex, position, position + length - 1));
-				bool overlap = false;
-				
-				if ( lowerBound != lcbIntervals.end() )
-				{
-					if ( refIndex == lowerBound->sequence && position + length - 1 >= lowerBound->start )
-					{
-						overlap = true;
 					}
 					
-					lowerBound--;
+					int position = row.position;
+					int length = row.length;
+					set<Interval>::iterator lowerBound = lcbIntervals.lower_bound(Interval(refIndex, position, position + length - 1));
+					bool overlap = false;
 					
-					if ( ! overlap && lowerBound != lcbIntervals.begin() )
+					if ( lowerBound != lcbIntervals.end() )
 					{
-						if ( refIndex == lowerBound->sequence && position <= lowerBound->end )
+						if ( refIndex == lowerBound->sequence && position + length - 1 >= lowerBound->start )
 						{
 							overlap = true;
 						}
+						
+						lowerBound--;
+						
+						if ( ! overlap && lowerBound != lcbIntervals.begin() )
+						{
+							if ( refIndex == lowerBound->sequence && position <= lowerBound->end )
+							{
+								overlap = true;
+							}
+						}
 					}
-				}
-				
-				if ( overlap )
-				{
-					// destroy lcb and eat alignment
-					
-					lcbs.resize(lcbs.size() - 1);
 					
-					while ( in.peek() != '\n' )
+					if ( overlap )
 					{
-						in.ignore(numeric_limits<streamsize>::max(), '\n');
+						// destroy lcb and skip the rest of the block
+						
+						lcbs.resize(lcbs.size() - 1);
+						lcb = 0;
+						break;
 					}
 					
-					lcb = 0;
+					lcbIntervals.insert(Interval(refIndex, position, position + length - 1));
 					
-					continue;
+					lcb->sequence = refIndex;
+					lcb->position = position;
+					lcbReverse = row.reverse;
 				}
 				
-				lcbIntervals.insert(Interval(refIndex, position, position + length - 1));
+				LcbList::Region * region = &lcb->regions[trackIndex];
 				
-				lcb->sequence = refIndex;
-				lcb->position = position;
-				lcbReverse = reverse;
-			}
-			
-			LcbList::Region * region = &lcb->regions[trackIndex];
-			
-			region->position = position + regionOffsetBySeqNameByTrack[trackIndex][seqName];
-			region->length = length;
-			region->reverse = reverse;
-			
-			// parse sequence
-			
-			if ( trackIndex == 0 || variantList )
-			{
-				string seq;
-				lineStream >> seq;
+				region->position = row.position + regionOffsetBySeqNameByTrack[trackIndex][row.sequence];
+				region->length = row.length;
+				region->reverse = row.reverse;
 				
 				if ( createReference && trackIndex == 0 )
 				{
-					string ungapped = seq;
-					ungap(ungapped);
+					// usually ungapped by the worker already
 					
-					if ( lcbReverse )
+					if ( block.ungappedRow == j )
 					{
-						reverseComplement(ungapped);
+						refs[refIndex].replace(lcb->position, block.ungapped.length(), block.ungapped);
+					}
+					else
+					{
+						string ungapped(row.seq, row.columns);
+						ungap(ungapped);
+						
+						if ( lcbReverse )
+						{
+							reverseComplement(ungapped);
+						}
+						
+						refs[refIndex].replace(lcb->position, ungapped.length(), ungapped);
 					}
-					
-					refs[refIndex].replace(lcb->position, ungapped.length(), ungapped);
 				}
 				
-				lcb->length = seq.length();
+				if ( trackIndex == 0 || variantList )
+				{
+					lcb->length = row.columns;
+				}
 				
 				if ( variantList )
 				{
-					seqs[trackIndex] = seq;
+					rows[trackIndex] = row.seq;
+					rowLengths[trackIndex] = row.columns;
 				}
 			}
-		}
-		else if ( variantList && line[0] == 0 && lcb != 0 )
-		{
-			for ( int i = 0; i < seqs.size(); i++ )
+			
+			if ( variantList && lcb != 0 )
 			{
-				for ( int j = 0; j < seqs[i].length(); j++ )
+				bool spans = true; // every track, with the same length
+				
+				for ( int j = 0; j < rows.size(); j++ )
 				{
-					seqs[i][j] = toupper(seqs[i][j]);
+					if ( rows[j] == 0 || rowLengths[j] != rowLengths[0] )
+					{
+						spans = false;
+					}
+				}
+				
+				if ( spans )
+				{
+					// the caller folds case as it scans and holds the chunk
+					// until it is done with it
+					
+					caller->add(rows, rowLengths[0], lcb->sequence, lcb->position, lcb->length, lcbReverse, true, chunk);
+				}
+				else
+				{
+					for ( int j = 0; j < seqs.size(); j++ )
+					{
+						if ( rows[j] )
+						{
+							seqs[j].assign(rows[j], rowLengths[j]);
+						}
+						
+						for ( int k = 0; k < seqs[j].length(); k++ )
+						{
+							seqs[j][k] = toupper(seqs[j][k]);
+						}
+					}
+					
+					caller->add(seqs, lcb->sequence, lcb->position, lcb->length, lcbReverse);
 				}
 			}
-			
-			variantList->addVariantsFromAlignment(seqs, *referenceList, lcb->sequence, lcb->position, lcb->length, lcbReverse);
-			
-			for ( int i = 0; i < seqs.size(); i++ )
+		}
+	};
+	
+	deque<future<shared_ptr<MafChunk> > > pending; // in file order
+	string text; // read but not yet in a chunk
+	bool more = true;
+	
+	while ( more )
+	{
+		size_t length = text.length();
+		
+		text.resize(length + mafChunkSize);
+		in.read(&text[length], mafChunkSize);
+		text.resize(length + in.gcount());
+		more = static_cast<bool>(in);
+		
+		// Chunks end before the last "a" line; what is left starts with it and
+		// has no other, so only the new text is searched.
+		
+		size_t chunkLength = more ? 0 : text.length();
+		
+		for ( size_t i = text.length(); more && i-- > max(length, (size_t)1); )
+		{
+			if ( text[i] == 'a' && text[i - 1] == '\n' )
 			{
-				seqs[i].clear();
+				chunkLength = i;
+				break;
 			}
-			
-			lcb = 0;
 		}
+		
+		if ( chunkLength == 0 )
+		{
+			continue;
+		}
+		
+		shared_ptr<MafChunk> chunk(new MafChunk());
+		
+		chunk->text.swap(text);
+		text.assign(chunk->text, chunkLength, string::npos);
+		chunk->text.resize(chunkLength);
+		
+		if ( pending.size() >= mafReadAheadPerThread * pool.getThreadCount() )
+		{
+			merge(pending.front().get());
+			pending.pop_front();
+		}
+		
+		// the reference track's rows are ungapped by the workers (or the
+		// first rows if no tracks are known yet)
+		
+		string ungapTrack = trackList->getTrackCount() ? trackList->getTrack(0).file : referenceTrack;
+		
+		pending.push_back(pool.submit([chunk, createReference, ungapTrack]()
+		{
+			parseMafChunk(*chunk, createReference, ungapTrack);
+			return chunk;
+		}));
+	}
+	
+	while ( pending.size() )
+	{
+		merge(pending.front().get());
+		pending.pop_front();
+	}
+	
+	if ( caller )
+	{
+		caller->finish();
 	}
 	
 	if ( queryCount && lcbs.size() == 0 )
@@ -562,7 +752,7 @@ void LcbList::initFromMfa(const char * file, ReferenceList * referenceList, Trac
 {
 	lcbs.resize(0);
 	
-	ifstream in(file);
+	InputStream in(file);
 	string line;
 	vector<string> seqs;
 	const bool oldTags = phylogenyTree->getRoot();
@@ -691,21 +881,58 @@ void LcbList::initFromProtocolBuffer(const Harvest::Alignment & msgAlignment)
 
 void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, TrackList * trackList, PhylogenyTree * phylogenyTree, VariantList * variantList)
 {
+	// The file is mapped and split into lines with memchr, so lines have no
+	// length limit. A sequence on one line is given to the variant caller as
+	// a span of the mapping, read as uppercase; only wrapped sequences are
+	// gathered into seqs. Header lines are copied to be parsed in place.
+	// Compressed files are streamed a line at a time instead, with every
+	// sequence gathered into seqs, so only the current LCB is held.
+	
 	lcbs.resize(0);
 	
-	ifstream in(file);
-	char * line = new char[1 << 20];
+	MappedFile mappedFile;
+	
+	if ( ! mappedFile.open(file) )
+	{
+		cerr << "ERROR: " << file << " could not be opened.";
+		return;
+	}
+	
+	const char * data = mappedFile.getData();
+	const char * dataEnd = data + mappedFile.getSize();
+	bool mapped = true;
+	ThreadPool pool; // shared by inflating and calling
+	InputStream in;
+	string lineStreamed;
+	
+	if ( dataEnd - data >= 2 && data[0] == '\x1f' && data[1] == '\x8b' )
+	{
+		mappedFile.close();
+		mapped = false;
+		
+		if ( ! in.open(file, &pool) )
+		{
+			cerr << "ERROR: " << file << " could not be opened.";
+			return;
+		}
+	}
+	
+	string header;
 	int trackIndex = 0;
-	vector<string> seqs;
+	vector<string> seqs; // wrapped sequences
+	vector<const char *> rows; // each sequence, in the mapping or seqs
+	vector<int> rowLengths;
 	const bool oldTags = phylogenyTree->getRoot();
 	int * trackIndecesNew;
 	bool mauve = false;
 	string ref;
 	bool createReference = referenceList->getReferenceCount() == 0;
+	unique_ptr<VariantList::AlignmentCaller> caller;
 	
 	if ( variantList )
 	{
 		variantList->init();
+		caller.reset(new VariantList::AlignmentCaller(*variantList, *referenceList, &pool));
 	}
 	
 	if ( oldTags )
@@ -723,11 +950,40 @@ void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, Tra
 	
 	TrackList::Track * track;
 	
-	while ( ! in.eof() )
+	while ( mapped ? data < dataEnd : static_cast<bool>(getline(in, lineStreamed)) )
 	{
-		in.getline(line, (1 << 20) - 1);
+		const char * text;
+		int length;
 		
-		if ( *line == '#' )
+		if ( mapped )
+		{
+			const char * lineEnd = (const char *)memchr(data, '\n', dataEnd - data);
+			
+			if ( lineEnd == 0 )
+			{
+				lineEnd = dataEnd;
+			}
+			
+			text = data;
+			length = lineEnd - data;
+			data = lineEnd + 1;
+		}
+		else
+		{
+			text = lineStreamed.data();
+			length = lineStreamed.length();
+		}
+		
+		char first = length ? *text : 0;
+		char * line = 0;
+		
+		if ( first == '#' || first == '>' )
+		{
+			header.assign(text, length);
+			line = &header[0];
+		}
+		
+		if ( first == '#' )
 		{
 			char * suffix;
 			
@@ -817,22 +1073,26 @@ void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, Tra
 				track->size = atoi(length_t.c_str());
 			}
 		}
-		else if ( *line == '>' )
+		else if ( first == '>' )
 		{
-			char * suffix = line + 1;
+			// >track:start-end strand ...
+			
+			char * field = line + 1;
 			
-			while ( *suffix == ' ' )
+			while ( *field == ' ' )
 			{
-				suffix++;
+				field++;
 			}
 			
-			trackIndex = atoi(strtok(suffix, ":")) - 1;
+			trackIndex = strtol(field, &field, 10) - 1;
 			
 			if ( lcb == 0 )
 			{
 				if ( variantList && lcbs.size() == 0 )
 				{
 					seqs.resize(trackList->getTrackCount());
+					rows.resize(trackList->getTrackCount(), 0);
+					rowLengths.resize(trackList->getTrackCount(), 0);
 				}
 				
 				lcbs.resize(lcbs.size() + 1);
@@ -854,14 +1114,14 @@ void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, Tra
 			
 			LcbList::Region * region = &lcb->regions[trackIndex];
 			
-			region->position = atoi(strtok(0, "-"));
+			region->position = strtol(*field ? field + 1 : field, &field, 10);
 			
 			if ( mauve )
 			{
 				region->position--;
 			}
 			
-			int end = atoi(strtok(0, " "));
+			int end = strtol(*field ? field + 1 : field, &field, 10);
 			
 			if ( mauve )
 			{
@@ -869,7 +1129,13 @@ void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, Tra
 			}
 			
 			region->length = end - region->position + 1;
-			region->reverse = *strtok(0, " ") == '-';
+			
+			while ( *field == ' ' )
+			{
+				field++;
+			}
+			
+			region->reverse = *field == '-';
 			
 			if ( trackIndex == 0 )
 			{
@@ -890,37 +1156,67 @@ void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, Tra
 				}
 			}
 		}
-		else if ( variantList && *line == '=' )
+		else if ( variantList && first == '=' )
 		{
 			bool all = true;
+			bool spans = true; // each on one line, with the same length
 			
 			for ( int i = 0; i < seqs.size(); i++ )
 			{
-				if ( seqs[i].length() == 0 )
+				if ( seqs[i].length() )
+				{
+					rows[i] = seqs[i].data();
+					rowLengths[i] = seqs[i].length();
+					spans = false;
+				}
+				
+				if ( rowLengths[i] == 0 )
 				{
 					all = false;
-					break;
+				}
+				
+				if ( rowLengths[i] != rowLengths[0] )
+				{
+					spans = false;
 				}
 			}
 			
 			if ( all )
 			{
-				for ( int i = 0; i < seqs.size(); i++ )
+				if ( createReference )
 				{
-					for ( int j = 0; j < seqs[i].length(); j++ )
+					string ungapped(rows[0], rowLengths[0]);
+					
+					for ( int j = 0; j < ungapped.length(); j++ )
 					{
-						seqs[i][j] = toupper(seqs[i][j]);
+						ungapped[j] = toupper(ungapped[j]);
 					}
-				}
-				
-				if ( createReference )
-				{
-					string ungapped = seqs[0];
+					
 					ungap(ungapped);
 					ref.replace(lcb->position, ungapped.length(), ungapped);
 				}
 				
-				variantList->addVariantsFromAlignment(seqs, *referenceList, lcb->sequence, lcb->position, lcbLength);
+				if ( spans )
+				{
+					caller->add(rows, rowLengths[0], lcb->sequence, lcb->position, lcbLength, false, true);
+				}
+				else
+				{
+					for ( int i = 0; i < seqs.size(); i++ )
+					{
+						if ( seqs[i].length() == 0 )
+						{
+							seqs[i].assign(rows[i], rowLengths[i]);
+						}
+						
+						for ( int j = 0; j < seqs[i].length(); j++ )
+						{
+							seqs[i][j] = toupper(seqs[i][j]);
+						}
+					}
+					
+					caller->add(seqs, lcb->sequence, lcb->position, lcbLength);
+				}
 			}
 			else
 			{
@@ -934,21 +1230,39 @@ void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, Tra
 			for ( int i = 0; i < seqs.size(); i++ )
 			{
 				seqs[i].clear();
+				rows[i] = 0;
+				rowLengths[i] = 0;
 			}
 		}
-		else if ( variantList )
+		else if ( variantList && lcb )
 		{
-			seqs[trackIndex].append(line);
+			// the first line of a sequence stays in the mapping; any more
+			// (or any streamed) gather it into seqs
+			
+			if ( mapped && rowLengths[trackIndex] == 0 )
+			{
+				rows[trackIndex] = text;
+				rowLengths[trackIndex] = length;
+			}
+			else
+			{
+				if ( rowLengths[trackIndex] && seqs[trackIndex].length() == 0 )
+				{
+					seqs[trackIndex].assign(rows[trackIndex], rowLengths[trackIndex]);
+				}
+				
+				seqs[trackIndex].append(text, length);
+			}
 		}
 		
-		if ( *line != '=' && *line != '>' && *line != '#')
+		if ( first != '=' && first != '>' && first != '#')
 		{
 			if ( trackIndex == 0 )
 			{
-				lcbLength += strlen(line);
+				lcbLength += length;
 			}
 		}
-		else if (*line == '=')
+		else if (first == '=')
 		{
 			if ( lcb )
 			{
@@ -959,6 +1273,11 @@ void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, Tra
 		}
 	}
 	
+	if ( caller )
+	{
+		caller->finish();
+	}
+	
 	if ( oldTags )
 	{
 		trackList->setTracksByFile();
@@ -977,9 +1296,6 @@ void LcbList::initFromXmfa(const char * file, ReferenceList * referenceList, Tra
 	{
 		variantList->sortVariants();
 	}
-	
-	delete [] line;
-	in.close();
 }
 
 void LcbList::initWithSingleLcb(const ReferenceList & referenceList, const TrackList & trackList)
@@ -1007,15 +1323,20 @@ void LcbList::initWithSingleLcb(const ReferenceList & referenceList, const Track
 	}
 }
 
-void LcbList::writeToCapnp(capnp::Harvest::Builder & harvestBuilder) const
+void LcbList::writeToCapnp(capnp::Harvest::Builder & harvestBuilder, int start, int count) const
 {
+	if ( count < 0 )
+	{
+		count = lcbs.size() - start;
+	}
+	
 	auto lcbListBuilder = harvestBuilder.initLcbList();
-	auto lcbsBuilder = lcbListBuilder.initLcbs(lcbs.size());
+	auto lcbsBuilder = lcbListBuilder.initLcbs(count);
 	
-	for ( int i = 0; i < lcbs.size(); i++ )
+	for ( int i = 0; i < count; i++ )
 	{
 		auto lcbBuilder = lcbsBuilder[i];
-		const LcbList::Lcb & lcb = lcbs.at(i);
+		const LcbList::Lcb & lcb = lcbs.at(start + i);
 		
 		lcbBuilder.setSequence(lcb.sequence);
 		lcbBuilder.setPosition(lcb.position);
@@ -1039,11 +1360,18 @@ void LcbList::writeToCapnp(capnp::Harvest::Builder & harvestBuilder) const
 	}
 }
 
-void LcbList::writeToMfa(ostream & out, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList) const
+void LcbList::writeToMfa(ostream & out, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList, const FilterExpression * expression) const
 {
 	// now iterate over alignments
 	
 	int totrefgaps = 0;
+	vector<char> allelesTracks;
+	vector<bool> selection;
+	
+	if ( expression )
+	{
+		variantList.getSelection(*expression, selection);
+	}
 	
 	for ( int i = 0; i < trackList.getTrackCount(); i++)
 	{
@@ -1052,6 +1380,18 @@ void LcbList::writeToMfa(ostream & out, const ReferenceList & referenceList, con
 		int width = 80;
 		int col = 0;
 		
+		// alleles are decoded alleleTile tracks at a time in track-major order
+		
+		if ( i % alleleTile == 0 )
+		{
+			int tracks = min(alleleTile, trackList.getTrackCount() - i);
+			
+			allelesTracks.resize((size_t)tracks * variantList.getVariantCount());
+			variantList.getTrackAlleles(0, variantList.getVariantCount(), i, tracks, allelesTracks.data());
+		}
+		
+		const char * allelesTrack = allelesTracks.data() + (size_t)(i % alleleTile) * variantList.getVariantCount();
+		
 		out << '>' << trackList.getTrack(i).file << endl;
 		
 		for ( int j = 0; j < lcbs.size(); j++ )
@@ -1063,13 +1403,13 @@ void LcbList::writeToMfa(ostream & out, const ReferenceList & referenceList, con
 			
 			int currpos = refstart;
 			int variantsSize = variantList.getVariantCount();
-			const VariantList::Variant * currvarref;
+			VariantList::Variant currvarref;
 			
 			if ( currvar < variantsSize )
 			{
-				currvarref = &variantList.getVariant(currvar);
+				currvarref = variantList.getVariant(currvar);
 			
-				if ( currvarref->alleles[0] == '-' )
+				if ( currvarref.alleles[0] == '-' )
 				{
 					currpos--;
 				}
@@ -1080,8 +1420,8 @@ void LcbList::writeToMfa(ostream & out, const ReferenceList & referenceList, con
 				currpos - refstart < lcb.regions.at(0).length ||
 				(
 					currvar < variantsSize &&
-					currvarref->sequence == refIndex &&
-					currvarref->position - refstart < lcb.regions.at(0).length
+					currvarref.sequence == refIndex &&
+					currvarref.position - refstart < lcb.regions.at(0).length
 				)
 			)
 			{
@@ -1101,9 +1441,9 @@ void LcbList::writeToMfa(ostream & out, const ReferenceList & referenceList, con
 				if
 				(
 					currvar == variantsSize ||
-					(currpos != currvarref->position && currpos >= refstart) ||
+					(currpos != currvarref.position && currpos >= refstart) ||
 					(
-						currvarref->reference == '-' &&
+						currvarref.reference == '-' &&
 						currvar > 0 &&
 						variantList.getVariant(currvar - 1).position != currpos &&
 						currpos >= refstart
@@ -1120,20 +1460,25 @@ void LcbList::writeToMfa(ostream & out, const ReferenceList & referenceList, con
 					}
 				}
 				
-				if ( currvar < variantsSize && currpos == currvarref->position )
+				if ( currvar < variantsSize && currpos == currvarref.position )
 				{
-					out << currvarref->alleles[i];
+					// unselected variants drop their column
+					
+					if ( ! expression || selection[currvar] )
+					{
+						out << allelesTrack[currvar];
+						col++;
+					}
+					
 					currvar++;
 					
 					if ( currvar < variantsSize )
 					{
-						currvarref = &variantList.getVariant(currvar);
+						currvarref = variantList.getVariant(currvar);
 					}
-					
-					col++;
 				}
 				
-				if ( currvar == variantsSize || currvarref->position > currpos || currvarref->sequence != refIndex )
+				if ( currvar == variantsSize || currvarref.position > currpos || currvarref.sequence != refIndex )
 				{
 					currpos++;
 				}
@@ -1144,11 +1489,18 @@ void LcbList::writeToMfa(ostream & out, const ReferenceList & referenceList, con
 		out << endl;
 	}
 }
-void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList) const
+void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList, const FilterExpression * expression) const
 {
 	// now iterate over alignments
 	
 	int totrefgaps = 0;
+	vector<char> allelesTracks;
+	vector<bool> selection;
+	
+	if ( expression )
+	{
+		variantList.getSelection(*expression, selection);
+	}
 	
 	for ( int i = 0; i < trackList.getTrackCount(); i++)
 	{
@@ -1157,6 +1509,18 @@ void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceL
 		int width = 80;
 		int col = 0;
 		
+		// alleles are decoded alleleTile tracks at a time in track-major order
+		
+		if ( i % alleleTile == 0 )
+		{
+			int tracks = min(alleleTile, trackList.getTrackCount() - i);
+			
+			allelesTracks.resize((size_t)tracks * variantList.getVariantCount());
+			variantList.getTrackAlleles(0, variantList.getVariantCount(), i, tracks, allelesTracks.data());
+		}
+		
+		const char * allelesTrack = allelesTracks.data() + (size_t)(i % alleleTile) * variantList.getVariantCount();
+		
 		out << '>' << trackList.getTrack(i).file << endl;
 		
 		for ( int j = 0; j < lcbs.size(); j++ )
@@ -1168,13 +1532,13 @@ void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceL
 			
 			int currpos = refstart;
 			int variantsSize = variantList.getVariantCount();
-			const VariantList::Variant * currvarref;
+			VariantList::Variant currvarref;
 			
 			if ( currvar < variantsSize )
 			{
-				currvarref = &variantList.getVariant(currvar);
+				currvarref = variantList.getVariant(currvar);
 			
-				if ( currvarref->alleles[0] == '-' )
+				if ( currvarref.alleles[0] == '-' )
 				{
 					currpos--;
 				}
@@ -1185,8 +1549,8 @@ void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceL
 				currpos - refstart < lcb.regions.at(0).length ||
 				(
 					currvar < variantsSize &&
-					currvarref->sequence == refIndex &&
-					currvarref->position - refstart < lcb.regions.at(0).length
+					currvarref.sequence == refIndex &&
+					currvarref.position - refstart < lcb.regions.at(0).length
 				)
 			)
 			{
@@ -1206,9 +1570,9 @@ void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceL
 				if
 				(
 					currvar == variantsSize ||
-					(currpos != currvarref->position && currpos >= refstart) ||
+					(currpos != currvarref.position && currpos >= refstart) ||
 					(
-						currvarref->reference == '-' &&
+						currvarref.reference == '-' &&
 						currvar > 0 &&
 						variantList.getVariant(currvar - 1).position != currpos &&
 						currpos >= refstart
@@ -1216,7 +1580,7 @@ void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceL
 				)
 				{
 				  // ALB -- do not output if this SNP has been filtered for some reason
-				  //if ( currvarref->filters == 0 ) {
+				  //if ( currvarref.filters == 0 ) {
 					out << referenceList.getReference(refIndex).sequence.at(currpos);
 					if(i == 0) {
 					  // believe our internal genome sequence index is 0-based, so add one here to be compatible with GenBank 1-based system
@@ -1232,11 +1596,11 @@ void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceL
 					}
 				}
 				
-				if ( currvar < variantsSize && currpos == currvarref->position )
+				if ( currvar < variantsSize && currpos == currvarref.position )
 				{
 				  // ALB -- do not output if this SNP has been filtered for some reason
-				  if ( currvarref->filters == 0 ) {
-					out << currvarref->alleles[i];
+				  if ( expression ? selection[currvar] : ! variantList.getFiltered(currvar) ) {
+					out << allelesTrack[currvar];
 					if(i == 0) {
 					  out2 << currpos + 1 << ",";
 					}
@@ -1245,13 +1609,13 @@ void LcbList::writeFilteredToMfa(ostream & out, ostream & out2, const ReferenceL
 					
 					if ( currvar < variantsSize )
 					{
-						currvarref = &variantList.getVariant(currvar);
+						currvarref = variantList.getVariant(currvar);
 					}
 					
 					col++;
 				}
 				
-				if ( currvar == variantsSize || currvarref->position > currpos || currvarref->sequence != refIndex )
+				if ( currvar == variantsSize || currvarref.position > currpos || currvarref.sequence != refIndex )
 				{
 					currpos++;
 				}
@@ -1294,7 +1658,7 @@ void LcbList::writeToProtocolBuffer(Harvest * msg) const
 	}
 }
 
-void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList) const
+void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList, const FilterExpression * expression) const
 {
 /* EXAMPLE header
 #FormatVersion MultiSNiP
@@ -1326,6 +1690,13 @@ void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, co
 	
 	int totrefgaps = 0;
 	int currvar = 0;
+	vector<char> allelesTracks;
+	vector<bool> selection;
+	
+	if ( expression )
+	{
+		variantList.getSelection(*expression, selection);
+	}
 	
 	for ( int j = 0; j < lcbs.size(); j++ )
 	{
@@ -1334,6 +1705,8 @@ void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, co
 		int refIndex = lcb.sequence;
 		int refend = 0;
 		int blockVarStart;
+		int blockVarEnd;
+		int blockTrackStart;
 		
 		for ( int r = 0; r < lcb.regions.size(); r++)
 		{
@@ -1350,6 +1723,19 @@ void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, co
 			else
 			{
 				currvar = blockVarStart;
+				
+				// the first region found the variants of the block; the
+				// rest are decoded alleleTile tracks at a time in
+				// track-major order
+				
+				if ( r == 1 || r % alleleTile == 0 )
+				{
+					blockTrackStart = r - r % alleleTile;
+					int tracks = min(alleleTile, (int)lcb.regions.size() - blockTrackStart);
+					
+					allelesTracks.resize((size_t)tracks * (blockVarEnd - blockVarStart));
+					variantList.getTrackAlleles(blockVarStart, blockVarEnd - blockVarStart, blockTrackStart, tracks, allelesTracks.data());
+				}
 			}
 			
 			out << ">" << r+1 << ":" << start << "-" << end << " ";
@@ -1368,13 +1754,13 @@ void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, co
 			int width = 80;
 			int col = 0;
 			int variantsSize = variantList.getVariantCount();
-			const VariantList::Variant * currvarref;
+			VariantList::Variant currvarref;
 			
 			if ( currvar < variantsSize )
 			{
-				currvarref = &variantList.getVariant(currvar);
+				currvarref = variantList.getVariant(currvar);
 			
-				if ( currvarref->alleles[0] == '-' )
+				if ( currvarref.alleles[0] == '-' )
 				{
 					currpos--;
 				}
@@ -1388,8 +1774,8 @@ void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, co
 				currpos - refstart < lcb.regions.at(0).length ||
 				(
 					currvar < variantsSize &&
-					currvarref->sequence == refIndex &&
-					currvarref->position - refstart < lcb.regions.at(0).length
+					currvarref.sequence == refIndex &&
+					currvarref.position - refstart < lcb.regions.at(0).length
 				)
 			)
 			{
@@ -1408,9 +1794,9 @@ void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, co
 				if
 				(
 					currvar == variantsSize ||
-					(currpos != currvarref->position && currpos >= refstart) ||
+					(currpos != currvarref.position && currpos >= refstart) ||
 					(
-						currvarref->alleles[0] == '-' &&
+						currvarref.alleles[0] == '-' &&
 						currvar > 0 &&
 						variantList.getVariant(currvar - 1).position != currpos &&
 						currpos >= refstart
@@ -1427,25 +1813,43 @@ void LcbList::writeToXmfa(ostream & out, const ReferenceList & referenceList, co
 					}
 				}
 				
-				if ( currvar < variantsSize && currpos == currvarref->position )
+				if ( currvar < variantsSize && currpos == currvarref.position )
 				{
-					out << currvarref->alleles[r];
+					// unselected variants drop their column
+					
+					if ( ! expression || selection[currvar] )
+					{
+						if ( r == 0 )
+						{
+							out << currvarref.alleles[r];
+						}
+						else
+						{
+							out << allelesTracks[(size_t)(r - blockTrackStart) * (blockVarEnd - blockVarStart) + currvar - blockVarStart];
+						}
+						
+						col++;
+					}
+					
 					currvar++;
 					
 					if ( currvar < variantsSize )
 					{
-						currvarref = &variantList.getVariant(currvar);
+						currvarref = variantList.getVariant(currvar);
 					}
-					
-					col++;
 				}
 				
-				if ( currvar == variantsSize || currvarref->position > currpos || currvarref->sequence != refIndex )
+				if ( currvar == variantsSize || currvarref.position > currpos || currvarref.sequence != refIndex )
 				{
 					currpos++;
 				}
 			}
 			
+			if ( r == 0 )
+			{
+				blockVarEnd = currvar;
+			}
+			
 			out << endl;
 		}
 		
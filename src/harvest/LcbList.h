@@ -16,6 +16,7 @@
 #include "harvest/capnp/harvest.capnp.h"
 #include "harvest/pb/harvest.pb.h"
 
+class FilterExpression;
 class VariantList;
 
 class LcbList
@@ -67,17 +68,17 @@ public:
 	const Lcb & getLcb(int index) const;
         double getCoreSize() const;
 	int getLcbCount() const;
-	void initFromCapnp(const capnp::Harvest::Reader & harvestReader);
+	void initFromCapnp(const capnp::Harvest::Reader & harvestReader, bool append = false);
 	void initFromMaf(const char * file, ReferenceList * referenceList, TrackList * trackList, PhylogenyTree * phylogenyTree, VariantList * variantList, const char * referenceFileName);
 	void initFromMfa(const char * file, ReferenceList * referenceList, TrackList * trackList, PhylogenyTree * phylogenyTree, VariantList * variantList);
 	void initFromProtocolBuffer(const Harvest::Alignment & msgAlignment);
 	void initFromXmfa(const char * file, ReferenceList * referenceList, TrackList * trackList, PhylogenyTree * phylogenyTree, VariantList * variantList);
 	void initWithSingleLcb(const ReferenceList & referenceList, const TrackList & trackList);
-	void writeToCapnp(capnp::Harvest::Builder & harvestBuilder) const;
-	void writeToMfa(std::ostream & out, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList) const;
-	void writeFilteredToMfa(std::ostream & out, std::ostream & out2, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList) const;
+	void writeToCapnp(capnp::Harvest::Builder & harvestBuilder, int start = 0, int count = -1) const;
+	void writeToMfa(std::ostream & out, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList, const FilterExpression * expression = 0) const;
+	void writeFilteredToMfa(std::ostream & out, std::ostream & out2, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList, const FilterExpression * expression = 0) const;
 	void writeToProtocolBuffer(Harvest * msg) const;
-	void writeToXmfa(std::ostream & out, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList) const;
+	void writeToXmfa(std::ostream & out, const ReferenceList & referenceList, const TrackList & trackList, const VariantList & variantList, const FilterExpression * expression = 0) const;
 	
 private:
 	
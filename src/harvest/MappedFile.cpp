@@ -0,0 +1,77 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "harvest/MappedFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile()
+{
+	data = 0;
+	size = 0;
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+void MappedFile::close()
+{
+	if ( data && size )
+	{
+		munmap((void *)data, size);
+	}
+	
+	data = 0;
+	size = 0;
+}
+
+bool MappedFile::open(const char * file)
+{
+	close();
+	
+	int fd = ::open(file, O_RDONLY);
+	
+	if ( fd < 0 )
+	{
+		return false;
+	}
+	
+	struct stat st;
+	
+	if ( fstat(fd, &st) != 0 )
+	{
+		::close(fd);
+		return false;
+	}
+	
+	if ( st.st_size == 0 )
+	{
+		// mmap refuses empty files; an empty span is still valid
+		
+		::close(fd);
+		data = "";
+		return true;
+	}
+	
+	void * mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	
+	::close(fd); // the mapping holds its own reference
+	
+	if ( mapped == MAP_FAILED )
+	{
+		return false;
+	}
+	
+	data = (const char *)mapped;
+	size = st.st_size;
+	
+	return true;
+}
@@ -0,0 +1,39 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef MappedFile_h
+#define MappedFile_h
+
+#include <stddef.h>
+
+// Read-only memory map of a whole file. The mapping is shared, so several
+// processes reading the same file share the page cache.
+
+class MappedFile
+{
+public:
+
+	MappedFile();
+	~MappedFile();
+	
+	void close();
+	const char * getData() const;
+	size_t getSize() const;
+	bool open(const char * file);
+
+private:
+
+	MappedFile(const MappedFile &);
+	MappedFile & operator=(const MappedFile &);
+	
+	const char * data;
+	size_t size;
+};
+
+inline const char * MappedFile::getData() const { return data; }
+inline size_t MappedFile::getSize() const { return size; }
+
+#endif
@@ -5,7 +5,7 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "PhylogenyTree.h"
-#include <fstream>
+#include "InputStream.h"
 
 using namespace::std;
 
@@ -124,7 +124,7 @@ void PhylogenyTree::initFromNewick(const char * file, TrackList * trackList)
 		delete root;
 	}
 	
-	ifstream in(file);
+	InputStream in(file);
 	char * line = new char[1 << 20];
 	
 	bool useNames = trackList->getTrackCount() == 0;
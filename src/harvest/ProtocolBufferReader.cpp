@@ -0,0 +1,233 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "harvest/ProtocolBufferReader.h"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+using namespace::std;
+using namespace::google::protobuf::io;
+
+static const int wireTypeVarint = 0;
+static const int wireTypeFixed64 = 1;
+static const int wireTypeLengthDelimited = 2;
+static const int wireTypeFixed32 = 5;
+
+void setTotalBytesLimit(CodedInputStream & coded)
+{
+	// the warning threshold argument was dropped in protobuf 3.6
+
+#if GOOGLE_PROTOBUF_VERSION >= 3006000
+	coded.SetTotalBytesLimit(INT_MAX);
+#else
+	coded.SetTotalBytesLimit(INT_MAX, INT_MAX);
+#endif
+}
+
+ProtocolBufferReader::ProtocolBufferReader()
+{
+	fd = -1;
+	fileStream = 0;
+	gzipStream = 0;
+	position = 0;
+	wireType = 0;
+	length = 0;
+	failed = false;
+}
+
+ProtocolBufferReader::~ProtocolBufferReader()
+{
+	if ( gzipStream )
+	{
+		delete gzipStream;
+	}
+	
+	if ( fileStream )
+	{
+		delete fileStream;
+	}
+	
+	if ( fd >= 0 )
+	{
+		close(fd);
+	}
+}
+
+bool ProtocolBufferReader::enter()
+{
+	if ( wireType != wireTypeLengthDelimited )
+	{
+		return fail();
+	}
+	
+	ends.push_back(position + length);
+	wireType = -1;
+	
+	return true;
+}
+
+bool ProtocolBufferReader::fail()
+{
+	failed = true;
+	return false;
+}
+
+bool ProtocolBufferReader::next(int & field)
+{
+	if ( failed )
+	{
+		return false;
+	}
+	
+	if ( ends.size() && position >= ends[ends.size() - 1] )
+	{
+		ends.pop_back();
+		return false;
+	}
+	
+	// the stream is destroyed before returning, which backs the underlying
+	// stream up to the end of what was actually read
+	
+	CodedInputStream coded(gzipStream);
+	
+	setTotalBytesLimit(coded);
+	
+	uint32_t tag = coded.ReadTag();
+	
+	if ( tag == 0 )
+	{
+		// end of file; an error within a nested message
+		
+		return ends.size() ? fail() : false;
+	}
+	
+	field = tag >> 3;
+	wireType = tag & 7;
+	
+	if ( wireType == wireTypeLengthDelimited && ! coded.ReadVarint64((google::protobuf::uint64 *)&length) )
+	{
+		return fail();
+	}
+	
+	position += coded.CurrentPosition();
+	return true;
+}
+
+bool ProtocolBufferReader::open(const char * file)
+{
+	fd = ::open(file, O_RDONLY);
+	
+	if ( fd < 0 )
+	{
+		return false;
+	}
+	
+	fileStream = new FileInputStream(fd);
+	gzipStream = new GzipInputStream(fileStream);
+	
+	return true;
+}
+
+bool ProtocolBufferReader::read(google::protobuf::MessageLite * message)
+{
+	if ( wireType != wireTypeLengthDelimited || length > INT_MAX )
+	{
+		return fail();
+	}
+	
+	CodedInputStream coded(gzipStream);
+	
+	setTotalBytesLimit(coded);
+	
+	CodedInputStream::Limit limit = coded.PushLimit(length);
+	
+	if ( ! message->ParseFromCodedStream(&coded) || ! coded.ConsumedEntireMessage() )
+	{
+		return fail();
+	}
+	
+	coded.PopLimit(limit);
+	position += length;
+	wireType = -1;
+	
+	return true;
+}
+
+bool ProtocolBufferReader::skip()
+{
+	// only one CodedInputStream may be open on the stream at a time; each is
+	// given the raised byte limit, since protobuf before 3.6 defaults to 64MB
+	
+	switch ( wireType )
+	{
+		case wireTypeVarint:
+		{
+			CodedInputStream coded(gzipStream);
+			google::protobuf::uint64 value;
+			
+			setTotalBytesLimit(coded);
+			
+			if ( ! coded.ReadVarint64(&value) )
+			{
+				return fail();
+			}
+			
+			position += coded.CurrentPosition();
+			break;
+		}
+		
+		case wireTypeFixed64:
+		case wireTypeFixed32:
+		{
+			CodedInputStream coded(gzipStream);
+			int size = wireType == wireTypeFixed64 ? 8 : 4;
+			
+			setTotalBytesLimit(coded);
+			
+			if ( ! coded.Skip(size) )
+			{
+				return fail();
+			}
+			
+			position += size;
+			break;
+		}
+		
+		case wireTypeLengthDelimited:
+		{
+			// skipped in pieces, each under the raised byte limit of its stream
+			
+			uint64_t remaining = length;
+			
+			while ( remaining > 0 )
+			{
+				CodedInputStream coded(gzipStream);
+				int size = remaining > (1 << 30) ? (1 << 30) : remaining;
+				
+				setTotalBytesLimit(coded);
+				
+				if ( ! coded.Skip(size) )
+				{
+					return fail();
+				}
+				
+				remaining -= size;
+			}
+			
+			position += length;
+			break;
+		}
+		
+		default:
+			return fail(); // groups are not used
+	}
+	
+	wireType = -1;
+	return true;
+}
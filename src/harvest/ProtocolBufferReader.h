@@ -0,0 +1,63 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef ProtocolBufferReader_h
+#define ProtocolBufferReader_h
+
+#include <vector>
+#include <stdint.h>
+#include <google/protobuf/message_lite.h>
+#include <google/protobuf/io/gzip_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+
+// Walks the fields of a (gzipped) protocol buffer file one at a time, so
+// large repeated fields can be read element by element instead of parsing
+// the whole message. Each field is read with its own CodedInputStream, which
+// keeps clear of the 2GB limit CodedInputStream places on a single stream.
+//
+//   while ( reader.next(field) )
+//   {
+//       if ( field == 1 ) reader.read(&message);
+//       else if ( field == 2 ) { reader.enter(); while ( reader.next(field) ) ...; }
+//       else reader.skip();
+//   }
+//
+// next() returns false at the end of the current nested message (which is
+// then left) or of the file; getFailed() tells the end apart from an error.
+
+class ProtocolBufferReader
+{
+public:
+
+	ProtocolBufferReader();
+	~ProtocolBufferReader();
+	
+	bool enter();
+	bool getFailed() const;
+	bool next(int & field);
+	bool open(const char * file);
+	bool read(google::protobuf::MessageLite * message);
+	bool skip();
+
+private:
+
+	bool fail();
+	
+	int fd;
+	google::protobuf::io::FileInputStream * fileStream;
+	google::protobuf::io::GzipInputStream * gzipStream;
+	std::vector<uint64_t> ends; // positions where entered messages end
+	uint64_t position; // in the decompressed stream
+	int wireType;
+	uint64_t length; // of the current field, if length-delimited
+	bool failed;
+};
+
+void setTotalBytesLimit(google::protobuf::io::CodedInputStream & coded);
+
+inline bool ProtocolBufferReader::getFailed() const { return failed; }
+
+#endif
@@ -4,7 +4,7 @@
 //
 // See the LICENSE.txt file included with this software for license information.
 
-#include <fstream>
+#include "InputStream.h"
 #include "ReferenceList.h"
 
 using namespace::std;
@@ -88,27 +88,34 @@ int ReferenceList::getReferenceSequenceFromName(string name) const
 	return undef;
 }
 
-void ReferenceList::initFromCapnp(const capnp::Harvest::Reader & harvestReader)
+void ReferenceList::initFromCapnp(const capnp::Harvest::Reader & harvestReader, bool append)
 {
 	auto referenceListReader = harvestReader.getReferenceList();
 	auto referencesReader = referenceListReader.getReferences();
 	
-	references.resize(0);
-	references.resize(referencesReader.size());
+	if ( ! append )
+	{
+		references.resize(0);
+	}
 	
-	for ( int i = 0; i < references.size(); i++ )
+	int start = references.size();
+	
+	references.resize(start + referencesReader.size());
+	
+	for ( int i = 0; i < referencesReader.size(); i++ )
 	{
 		auto referenceReader = referencesReader[i];
+		Reference & reference = references[start + i];
 		
-		references[i].name = parseNameFromTag(referenceReader.getTag());
-		references[i].description = parseDescriptionFromTag(referenceReader.getTag());
-		references[i].sequence = referenceReader.getSequence();
+		reference.name = parseNameFromTag(referenceReader.getTag());
+		reference.description = parseDescriptionFromTag(referenceReader.getTag());
+		reference.sequence = referenceReader.getSequence();
 	}
 }
 
 void ReferenceList::initFromFasta(const char * file)
 {
-	ifstream in(file);
+	InputStream in(file);
 	string line;
 	Reference * reference;
 	
@@ -153,15 +160,20 @@ void ReferenceList::initFromProtocolBuffer(const Harvest::Reference & msg)
 	}
 }
 
-void ReferenceList::writeToCapnp(capnp::Harvest::Builder & harvestBuilder) const
+void ReferenceList::writeToCapnp(capnp::Harvest::Builder & harvestBuilder, int start, int count) const
 {
+	if ( count < 0 )
+	{
+		count = references.size() - start;
+	}
+	
 	auto referenceListBuilder = harvestBuilder.initReferenceList();
-	auto referencesBuilder = referenceListBuilder.initReferences(references.size());
+	auto referencesBuilder = referenceListBuilder.initReferences(count);
 	
-	for ( int i = 0; i < references.size(); i++ )
+	for ( int i = 0; i < count; i++ )
 	{
 		auto referenceBuilder = referencesBuilder[i];
-		const Reference & reference = references.at(i);
+		const Reference & reference = references.at(start + i);
 		
 		string tag = reference.name;
 		
@@ -65,10 +65,10 @@ public:
 	int getReferenceSequenceFromConcatenated(long int position) const;
 	int getReferenceSequenceFromAcc(const std::string & acc) const;
 	int getReferenceSequenceFromName(std::string name) const;
-	void initFromCapnp(const capnp::Harvest::Reader & harvestReader);
+	void initFromCapnp(const capnp::Harvest::Reader & harvestReader, bool append = false);
 	void initFromFasta(const char * file);
 	void initFromProtocolBuffer(const Harvest::Reference & msg);
-	void writeToCapnp(capnp::Harvest::Builder & harvestBuilder) const;
+	void writeToCapnp(capnp::Harvest::Builder & harvestBuilder, int start = 0, int count = -1) const;
 	void writeToFasta(std::ostream & out) const;
 	void writeToProtocolBuffer(Harvest * msg) const;
 	
@@ -0,0 +1,87 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "harvest/ThreadPool.h"
+
+using namespace::std;
+
+int ThreadPool::defaultThreadCount = 0;
+
+ThreadPool::ThreadPool(int threadCount)
+{
+	stopping = false;
+	
+	if ( threadCount <= 0 )
+	{
+		threadCount = getDefaultThreadCount();
+	}
+	
+	for ( int i = 0; i < threadCount; i++ )
+	{
+		threads.push_back(thread(&ThreadPool::work, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(tasksMutex);
+		stopping = true;
+	}
+	
+	tasksCondition.notify_all();
+	
+	for ( int i = 0; i < threads.size(); i++ )
+	{
+		threads[i].join();
+	}
+}
+
+int ThreadPool::getDefaultThreadCount()
+{
+	if ( defaultThreadCount > 0 )
+	{
+		return defaultThreadCount;
+	}
+	
+	int hardware = thread::hardware_concurrency();
+	
+	return hardware > 0 ? hardware : 1;
+}
+
+void ThreadPool::setDefaultThreadCount(int threadCountNew)
+{
+	defaultThreadCount = threadCountNew;
+}
+
+void ThreadPool::work()
+{
+	while ( true )
+	{
+		function<void()> task;
+		
+		{
+			unique_lock<mutex> lock(tasksMutex);
+			
+			while ( ! stopping && tasks.empty() )
+			{
+				tasksCondition.wait(lock);
+			}
+			
+			if ( tasks.empty() )
+			{
+				// only reached when stopping; queued tasks are always drained
+				
+				return;
+			}
+			
+			task = tasks.front();
+			tasks.pop();
+		}
+		
+		task();
+	}
+}
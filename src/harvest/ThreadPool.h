@@ -0,0 +1,68 @@
+// Copyright © 2014, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen, and
+// Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef ThreadPool_h
+#define ThreadPool_h
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+
+	ThreadPool(int threadCount = 0); // 0 uses the default thread count
+	~ThreadPool();
+	
+	int getThreadCount() const;
+	
+	template<class Function>
+	std::future<typename std::result_of<Function()>::type> submit(Function function);
+	
+	static int getDefaultThreadCount();
+	static void setDefaultThreadCount(int threadCountNew);
+
+private:
+
+	void work();
+	
+	std::vector<std::thread> threads;
+	std::queue<std::function<void()> > tasks;
+	std::mutex tasksMutex;
+	std::condition_variable tasksCondition;
+	bool stopping;
+	
+	static int defaultThreadCount;
+};
+
+template<class Function>
+std::future<typename std::result_of<Function()>::type> ThreadPool::submit(Function function)
+{
+	typedef typename std::result_of<Function()>::type Result;
+	
+	// std::function must be copyable, so the task is shared
+	//
+	std::shared_ptr<std::packaged_task<Result()> > task(new std::packaged_task<Result()>(function));
+	std::future<Result> result = task->get_future();
+	
+	{
+		std::lock_guard<std::mutex> lock(tasksMutex);
+		tasks.push([task]() { (*task)(); });
+	}
+	
+	tasksCondition.notify_one();
+	return result;
+}
+
+inline int ThreadPool::getThreadCount() const { return threads.size(); }
+
+#endif
@@ -5,214 +5,1403 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "harvest/VariantList.h"
-#include <fstream>
+#include "harvest/FilterExpression.h"
+#include "harvest/InputStream.h"
 #include <sstream>
 #include "harvest/parse.h"
+#include "harvest/ThreadPool.h"
 #include <set>
 #include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#include <immintrin.h>
+#define ALLELE_DECODE_SSSE3
+#define ALIGNMENT_SCAN_AVX2
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace::std;
 
-bool operator<(const VariantList::VariantSortKey & a, const VariantList::VariantSortKey & b)
+// 4-bit code of each character (see alleleSymbols)
+//
+static struct AlleleCodes
 {
-	if ( a.sequence == b.sequence )
+	AlleleCodes()
 	{
-		if ( a.position == b.position )
+		for ( int i = 0; i < 256; i++ )
 		{
-			return a.offset < b.offset;
+			codes[i] = alleleEscape;
 		}
-		else
+		
+		for ( int i = 0; i < alleleEscape; i++ )
 		{
-			return a.position < b.position;
+			codes[(unsigned char)alleleSymbols[i]] = i;
 		}
 	}
-	else
+	
+	uint8_t codes[256];
+} alleleCodes;
+
+#ifdef ALLELE_DECODE_SSSE3
+__attribute__((target("ssse3")))
+static int decodeAllelesSsse3(const uint8_t * packed, int count, char * decoded)
+{
+	// nibbles index alleleSymbols with a byte shuffle, 32 alleles at a time
+	
+	const __m128i symbols = _mm_loadu_si128((const __m128i *)alleleSymbols);
+	const __m128i mask = _mm_set1_epi8(15);
+	int i = 0;
+	
+	for ( ; i + 32 <= count; i += 32 )
 	{
-		return a.sequence < b.sequence;
+		__m128i bytes = _mm_loadu_si128((const __m128i *)(packed + i / 2));
+		__m128i low = _mm_and_si128(bytes, mask);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+		
+		_mm_storeu_si128((__m128i *)(decoded + i), _mm_shuffle_epi8(symbols, _mm_unpacklo_epi8(low, high)));
+		_mm_storeu_si128((__m128i *)(decoded + i + 16), _mm_shuffle_epi8(symbols, _mm_unpackhi_epi8(low, high)));
 	}
+	
+	return i;
 }
+#endif
 
-void VariantList::addFilterFromBed(const char * file, const char * name, const char * desc)
+// boundary of a BED interval; change is 1 where the filter starts covering and
+// -1 past its end
+//
+struct BedBoundary
 {
-	ifstream in(file);
-	char * line = new char[1 << 20];
-	int i = 0;
-	long long int flag = 1 << filters.size();
-	
-	addFilter(flag, name, desc);
+	int position;
+	int filter;
+	int change;
 	
-	while ( ! in.eof() )
+	bool operator<(const BedBoundary & other) const { return position < other.position; }
+};
+
+// filters covering each stretch of a sequence, from each start to the next,
+// as a flag word followed by the words of flagsExtra
+//
+struct BedSegments
+{
+	vector<int> starts;
+	vector<uint64_t> flags;
+};
+
+static bool bitsContain(const uint64_t * bits, const uint64_t * subset, int words)
+{
+	for ( int i = 0; i < words; i++ )
 	{
-		in.getline(line, (1 << 20) - 1);
-		
-		if ( in.eof() )
+		if ( subset[i] & ~bits[i] )
 		{
-			break;
+			return false;
 		}
-		
-		int seq = atoi(strtok(line, "\t")) - 1;
-		int start = atoi(strtok(0, "\t")) - 1;
-		int end = atoi(strtok(0, "\t")) - 1;
-		
-		// seek to interval start
-		//
-		while
-		(
-			i < variants.size() &&
-			(
-				variants.at(i).sequence < seq ||
-				(
-					variants.at(i).sequence == seq &&
-					variants.at(i).position < start
-				)
-			)
-		)
+	}
+	
+	return true;
+}
+
+static bool bitsEqual(const uint64_t * a, const uint64_t * b, int words)
+{
+	for ( int i = 0; i < words; i++ )
+	{
+		if ( a[i] != b[i] )
 		{
-			i++;
+			return false;
 		}
-		
-		// set flags through interval
-		//
-		while
-		(
-			i < variants.size() &&
-			variants.at(i).sequence == seq &&
-			variants.at(i).position <= end
-		)
+	}
+	
+	return true;
+}
+
+static bool bitsIntersect(const uint64_t * a, const uint64_t * b, int words)
+{
+	for ( int i = 0; i < words; i++ )
+	{
+		if ( a[i] & b[i] )
 		{
-			variants[i].filters = variants.at(i).filters | flag;
-			i++;
+			return true;
 		}
 	}
 	
-	delete [] line;
+	return false;
 }
 
-void VariantList::addVariantsFromAlignment(const vector<string> & seqs, const ReferenceList & referenceList, int sequence, int position, int length, bool reverse)
+// transposes an alleleTile x alleleTile block of bytes
+//
+static void transposeTile(const char * in, char * out)
 {
-//	Harvest::Variation * msg = harvest.mutable_variation();
-	char col[seqs.size() + 1];
-        //add arrays for tracking conserved,poorly aligned columns
-	vector<bool> conserved(seqs[0].length()+1,true);
-	vector<bool> gaps(seqs[0].length()+1,false);
-	vector<bool> nns(seqs[0].length()+1,false);
-	int offset = 0;
+#ifdef __SSE2__
+	// 16 x 16 blocks, each by four rounds of interleaving 8-, 16-, 32- and
+	// 64-bit lanes of row pairs, which leaves columns in bit-reversed order
 	
-	col[seqs.size()] = 0; // null-terminate for use as a c-style string
+	static const int columns[16] = {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15};
 	
-        //simple loop to check for column conservation
-        //this could be done via SP-score all-v-all pairs
-        //but for now, simply use to flag SNPs that are within a window of 100bp
-        //with less than 50% column conservation (w.r.t ref, not consensus)
-	for ( int i = 0; i < seqs[0].length(); i++ )
+	for ( int i = 0; i < alleleTile; i += 16 )
 	{
-		bool variant = false;
-		bool indel = false;
-		vector<int> nt_cnt(5,0);
-		//vector<int>::iterator maxval;
-		
-		for (int j = 0; j < seqs.size(); j++)
+		for ( int j = 0; j < alleleTile; j += 16 )
 		{
-			if ( reverse )
+			__m128i a[16];
+			__m128i b[16];
+			
+			for ( int k = 0; k < 16; k++ )
 			{
-				col[j] = seqs[j][seqs[0].length() - i - 1];
+				a[k] = _mm_loadu_si128((const __m128i *)(in + (i + k) * alleleTile + j));
 			}
-			else
+			
+			for ( int k = 0; k < 8; k++ )
 			{
-				col[j] = seqs[j][i];
+				b[k] = _mm_unpacklo_epi8(a[2 * k], a[2 * k + 1]);
+				b[k + 8] = _mm_unpackhi_epi8(a[2 * k], a[2 * k + 1]);
 			}
-
-  		    if (col[j] == 'a' || col[j] == 'A')
-		      nt_cnt[0] =1;
-  		    else if (col[j] == 't' || col[j] == 'T')
-		      nt_cnt[1] =1;
-  		    else if (col[j] == 'g' || col[j] == 'G')
-		      nt_cnt[2] =1;
-  		    else if (col[j] == 'c' || col[j] == 'C')
-		      nt_cnt[3] =1;
-  		    else if (col[j] == 'n' || col[j] == 'N')
-		      nns[i] = true;
-  		    else if (col[j] == '-')
-		    {
-		      gaps[i] = true;
-                      nt_cnt[4] = 1;
-		    }
-                }
-                //maxval = std::max_element(nt_cnt.begin(),nt_cnt.end());
-                if ((nt_cnt[0] + nt_cnt[1] + nt_cnt[2] + nt_cnt[3] +nt_cnt[4]) > 1)
-                  conserved[i] = false;
-                /*multi-allelic
-                if ((nt_cnt[0] + nt_cnt[1] + nt_cnt[2] + nt_cnt[3] +nt_cnt[4]) > 2)
+			
+			for ( int k = 0; k < 8; k++ )
+			{
+				a[k] = _mm_unpacklo_epi16(b[2 * k], b[2 * k + 1]);
+				a[k + 8] = _mm_unpackhi_epi16(b[2 * k], b[2 * k + 1]);
+			}
+			
+			for ( int k = 0; k < 8; k++ )
+			{
+				b[k] = _mm_unpacklo_epi32(a[2 * k], a[2 * k + 1]);
+				b[k + 8] = _mm_unpackhi_epi32(a[2 * k], a[2 * k + 1]);
+			}
+			
+			for ( int k = 0; k < 8; k++ )
+			{
+				a[k] = _mm_unpacklo_epi64(b[2 * k], b[2 * k + 1]);
+				a[k + 8] = _mm_unpackhi_epi64(b[2 * k], b[2 * k + 1]);
+			}
+			
+			for ( int k = 0; k < 16; k++ )
+			{
+				_mm_storeu_si128((__m128i *)(out + (j + columns[k]) * alleleTile + i), a[k]);
+			}
+		}
+	}
+#else
+	for ( int i = 0; i < alleleTile; i++ )
+	{
+		for ( int j = 0; j < alleleTile; j++ )
 		{
-		  conserved[i] = false;
+			out[j * alleleTile + i] = in[i * alleleTile + j];
 		}
-                */
 	}
+#endif
+}
+
+// decodes a packed row, leaving escapes 0
+//
+static void decodeAlleles(const uint8_t * packed, int count, char * decoded)
+{
+	int i = 0;
+
+#ifdef ALLELE_DECODE_SSSE3
+	static const bool ssse3 = __builtin_cpu_supports("ssse3");
 	
-	// Since insertions to the reference take on the left-most reference
-	// position, this allows the alignment to start with an insertion
-	// (possibly at reference position -1).
-	//
-	position--;
+	if ( ssse3 )
+	{
+		i = decodeAllelesSsse3(packed, count, decoded);
+	}
+#endif
+
+	for ( ; i < count; i++ )
+	{
+		decoded[i] = alleleSymbols[packed[i / 2] >> (i % 2 * 4) & 15];
+	}
+}
+
+static char upperCase(char c)
+{
+	return c >= 'a' && c <= 'z' ? c - 32 : c;
+}
+
+// columns of an alignment stripe (bit i for column start + i)
+//
+struct ColumnMasks
+{
+	uint64_t variant; // a row differs from the first (ignoring case if folded)
+	uint64_t gap; // any row has a gap
+	uint64_t n; // a row other than the first has an N
+	uint64_t conserved; // rows share at most one of A, C, G, T and gap
+};
+
+// columns with at most one class present, from the presence of each
+//
+static uint64_t columnsConserved(const uint64_t * bases, uint64_t gap)
+{
+	uint64_t seen = gap;
+	uint64_t multiple = 0;
 	
-	for ( int i = 0; i < seqs[0].length(); i++ )
+	for ( int i = 0; i < 4; i++ )
 	{
-		bool variant = false;
-		bool n = false;
-		
-		if ( reverse )
+		multiple |= seen & bases[i];
+		seen |= bases[i];
+	}
+	
+	return ~multiple;
+}
+
+#ifdef ALIGNMENT_SCAN_AVX2
+__attribute__((target("avx2")))
+static __m256i foldCaseAvx2(__m256i bytes)
+{
+	__m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), bytes));
+	
+	return _mm256_sub_epi8(bytes, _mm256_and_si256(lower, _mm256_set1_epi8(32)));
+}
+
+__attribute__((target("avx2")))
+static void scanColumnsAvx2(const char * const * rows, int rowCount, int start, bool fold, ColumnMasks & masks)
+{
+	// each row is compared 32 columns at a time, with byte compares
+	// collapsed to bits by movemask
+	
+	const __m256i gap = _mm256_set1_epi8('-');
+	const __m256i n = _mm256_set1_epi8('N');
+	const __m256i bases[4] = {_mm256_set1_epi8('A'), _mm256_set1_epi8('C'), _mm256_set1_epi8('G'), _mm256_set1_epi8('T')};
+	__m256i first[2];
+	uint64_t basesPresent[4] = {0, 0, 0, 0};
+	
+	for ( int h = 0; h < 2; h++ )
+	{
+		first[h] = _mm256_loadu_si256((const __m256i *)(rows[0] + start + h * 32));
+		first[h] = fold ? foldCaseAvx2(first[h]) : first[h];
+	}
+	
+	masks.variant = 0;
+	masks.gap = 0;
+	masks.n = 0;
+	
+	for ( int j = 0; j < rowCount; j++ )
+	{
+		for ( int h = 0; h < 2; h++ )
 		{
-			col[0] = seqs[0][seqs[0].length() - i - 1];
+			__m256i bytes = _mm256_loadu_si256((const __m256i *)(rows[j] + start + h * 32));
+			__m256i upper = foldCaseAvx2(bytes);
+			int shift = h * 32;
+			
+			masks.variant |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(_mm256_cmpeq_epi8(fold ? upper : bytes, first[h])) << shift;
+			masks.gap |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, gap)) << shift;
+			
+			if ( j )
+			{
+				masks.n |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(upper, n)) << shift;
+			}
+			
+			for ( int k = 0; k < 4; k++ )
+			{
+				basesPresent[k] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(upper, bases[k])) << shift;
+			}
 		}
-		else
+	}
+	
+	masks.conserved = columnsConserved(basesPresent, masks.gap);
+}
+#endif
+
+#ifdef __SSE2__
+static __m128i foldCaseSse2(__m128i bytes)
+{
+	__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('z' + 1)));
+	
+	return _mm_sub_epi8(bytes, _mm_and_si128(lower, _mm_set1_epi8(32)));
+}
+
+static void scanColumnsSse2(const char * const * rows, int rowCount, int start, bool fold, ColumnMasks & masks)
+{
+	// as scanColumnsAvx2, 16 columns at a time
+	
+	const __m128i gap = _mm_set1_epi8('-');
+	const __m128i n = _mm_set1_epi8('N');
+	const __m128i bases[4] = {_mm_set1_epi8('A'), _mm_set1_epi8('C'), _mm_set1_epi8('G'), _mm_set1_epi8('T')};
+	__m128i first[4];
+	uint64_t basesPresent[4] = {0, 0, 0, 0};
+	
+	for ( int h = 0; h < 4; h++ )
+	{
+		first[h] = _mm_loadu_si128((const __m128i *)(rows[0] + start + h * 16));
+		first[h] = fold ? foldCaseSse2(first[h]) : first[h];
+	}
+	
+	masks.variant = 0;
+	masks.gap = 0;
+	masks.n = 0;
+	
+	for ( int j = 0; j < rowCount; j++ )
+	{
+		for ( int h = 0; h < 4; h++ )
 		{
-			col[0] = seqs[0][i];
+			__m128i bytes = _mm_loadu_si128((const __m128i *)(rows[j] + start + h * 16));
+			__m128i upper = foldCaseSse2(bytes);
+			int shift = h * 16;
+			
+			masks.variant |= (uint64_t)(~_mm_movemask_epi8(_mm_cmpeq_epi8(fold ? upper : bytes, first[h])) & 0xffff) << shift;
+			masks.gap |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, gap)) << shift;
+			
+			if ( j )
+			{
+				masks.n |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(upper, n)) << shift;
+			}
+			
+			for ( int k = 0; k < 4; k++ )
+			{
+				basesPresent[k] |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(upper, bases[k])) << shift;
+			}
 		}
+	}
+	
+	masks.conserved = columnsConserved(basesPresent, masks.gap);
+}
+#endif
+
+// compares count (at most 64) columns of the rows from start, optionally as if
+// they were uppercase; full stripes use the widest vectors the CPU has
+//
+static void scanColumns(const char * const * rows, int rowCount, int start, int count, bool fold, ColumnMasks & masks)
+{
+	if ( count == 64 )
+	{
+#ifdef ALIGNMENT_SCAN_AVX2
+		static const bool avx2 = __builtin_cpu_supports("avx2");
 		
-		bool indel = col[0] == '-';
-		
-		if ( indel )
-		{
-			// insertion relative to the reference
-			offset++;
-		}
-		else
+		if ( avx2 )
 		{
-			position++;
-			offset = 0;
+			scanColumnsAvx2(rows, rowCount, start, fold, masks);
+			return;
 		}
+#endif
+#ifdef __SSE2__
+		scanColumnsSse2(rows, rowCount, start, fold, masks);
+		return;
+#endif
+	}
+	
+	uint64_t basesPresent[4] = {0, 0, 0, 0};
+	
+	masks.variant = 0;
+	masks.gap = 0;
+	masks.n = 0;
+	
+	for ( int j = 0; j < rowCount; j++ )
+	{
+		const char * row = rows[j] + start;
 		
-		for ( int j = 1; j < seqs.size(); j++ )
+		for ( int i = 0; i < count; i++ )
 		{
-			if ( reverse )
+			uint64_t bit = (uint64_t)1 << i;
+			char upper = upperCase(row[i]);
+			
+			if ( fold ? upper != upperCase(rows[0][start + i]) : row[i] != rows[0][start + i] )
 			{
-				col[j] = seqs[j][seqs[0].length() - i - 1];
+				masks.variant |= bit;
 			}
-			else
+			
+			if ( row[i] == '-' )
 			{
-				col[j] = seqs[j][i];
+				masks.gap |= bit;
 			}
-		
-			if ( ! variant && col[j] != col[0] )
+			else if ( upper == 'N' )
 			{
-				variant = true;
+				masks.n |= j ? bit : 0;
 			}
-			
-			if ( ! indel && col[j] == '-' )
+			else if ( upper == 'A' )
 			{
-				indel = true;
+				basesPresent[0] |= bit;
 			}
-			
-			if ( col[j] == 'N' || col[j] == 'n' )
+			else if ( upper == 'C' )
 			{
-				n = true;
+				basesPresent[1] |= bit;
 			}
+			else if ( upper == 'G' )
+			{
+				basesPresent[2] |= bit;
+			}
+			else if ( upper == 'T' )
+			{
+				basesPresent[3] |= bit;
+			}
+		}
+	}
+	
+	masks.conserved = columnsConserved(basesPresent, masks.gap);
+}
+
+// gathers values into the order given by an index
+//
+template<class T>
+static void reorder(vector<T> & values, const vector<int> & order)
+{
+	vector<T> ordered(order.size());
+	
+	for ( int i = 0; i < order.size(); i++ )
+	{
+		ordered[i] = values[order[i]];
+	}
+	
+	values.swap(ordered);
+}
+
+static const int vcfBatchLines = 4096;
+static const size_t vcfBatchBytes = 1 << 20;
+
+// span of a VCF line
+//
+struct VcfField
+{
+	const char * text;
+	int length;
+};
+
+// fields of a VCF line, tokenized in place; header lines are left unparsed
+//
+struct VcfRecord
+{
+	string line;
+	int lineIndex;
+	bool data; // false for headers and blank lines
+	
+	VcfField chrom;
+	int position;
+	VcfField ref;
+	vector<VcfField> alts;
+	float quality;
+	vector<VcfField> filters;
+	vector<int> alleleIndeces; // first allele of each genotype, or -1 if missing
+	bool missing;
+};
+
+static bool isVcfSpace(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// takes the next whitespace-delimited field, as operator>> would
+//
+static bool getVcfField(const char *& text, VcfField & field)
+{
+	while ( isVcfSpace(*text) )
+	{
+		text++;
+	}
+	
+	field.text = text;
+	
+	while ( *text && ! isVcfSpace(*text) )
+	{
+		text++;
+	}
+	
+	field.length = text - field.text;
+	return field.length != 0;
+}
+
+// splits a field as getline() with a delimiter would, so a trailing delimiter
+// adds no empty part
+//
+static void splitVcfField(const VcfField & field, char delimiter, vector<VcfField> & parts)
+{
+	const char * start = field.text;
+	const char * end = field.text + field.length;
+	
+	parts.clear();
+	
+	while ( start < end )
+	{
+		const char * stop = (const char *)memchr(start, delimiter, end - start);
+		
+		if ( stop == 0 )
+		{
+			stop = end;
+		}
+		
+		VcfField part = {start, (int)(stop - start)};
+		parts.push_back(part);
+		start = stop + 1;
+	}
+}
+
+static void parseVcfRecord(VcfRecord & record)
+{
+	const char * text = record.line.c_str();
+	VcfField positionField;
+	VcfField field;
+	
+	record.alts.clear();
+	record.filters.clear();
+	record.alleleIndeces.clear();
+	record.missing = false;
+	record.quality = 0;
+	
+	record.data =
+		text[0] != '#' &&
+		getVcfField(text, record.chrom) &&
+		getVcfField(text, positionField) &&
+		getVcfField(text, field) && // ID
+		getVcfField(text, record.ref) &&
+		getVcfField(text, field);
+	
+	if ( ! record.data )
+	{
+		return;
+	}
+	
+	record.position = atoi(positionField.text);
+	splitVcfField(field, ',', record.alts);
+	
+	if ( getVcfField(text, field) )
+	{
+		// "." (or anything else that isn't a number) is 0
+		
+		record.quality = strtof(field.text, 0);
+	}
+	
+	if ( getVcfField(text, field) )
+	{
+		splitVcfField(field, ':', record.filters);
+	}
+	
+	if ( ! getVcfField(text, field) || ! getVcfField(text, field) ) // INFO, FORMAT
+	{
+		return;
+	}
+	
+	// the genotypes, of which only the first allele is used; atoi() is
+	// unrolled since there is one per track per line
+	
+	while ( getVcfField(text, field) )
+	{
+		const char * digit = field.text;
+		
+		if ( *digit == '.' )
+		{
+			record.missing = true;
+			record.alleleIndeces.push_back(-1);
+			continue;
+		}
+		
+		bool negative = *digit == '-';
+		int value = 0;
+		
+		digit += negative || *digit == '+';
+		
+		while ( (unsigned char)(*digit - '0') < 10 )
+		{
+			value = value * 10 + *digit - '0';
+			digit++;
+		}
+		
+		record.alleleIndeces.push_back(negative ? -value : value);
+	}
+}
+
+// Reads a VCF in batches of lines that are tokenized on a thread pool while
+// earlier batches are used, returning records in file order. Batches are
+// recycled, so their lines and vectors stop allocating once warm.
+//
+class VcfReader
+{
+public:
+
+	VcfReader(istream & inNew)
+		: in(inNew)
+	{
+		lineIndex = 1;
+		currentIndex = 0;
+		end = false;
+	}
+	
+	const VcfRecord * next(); // 0 at the end; valid until the next call
+
+private:
+
+	struct Batch
+	{
+		vector<VcfRecord> records;
+		int count;
+	};
+	
+	void readBatch();
+	
+	istream & in;
+	ThreadPool pool;
+	deque<future<shared_ptr<Batch> > > pending; // in file order
+	vector<shared_ptr<Batch> > spare;
+	shared_ptr<Batch> current;
+	int currentIndex;
+	int lineIndex;
+	bool end;
+};
+
+const VcfRecord * VcfReader::next()
+{
+	if ( current && currentIndex < current->count )
+	{
+		return &current->records[currentIndex++];
+	}
+	
+	if ( current )
+	{
+		spare.push_back(current);
+		current.reset();
+	}
+	
+	while ( ! end && pending.size() <= 2 * pool.getThreadCount() )
+	{
+		readBatch();
+	}
+	
+	if ( pending.size() == 0 )
+	{
+		return 0;
+	}
+	
+	current = pending.front().get();
+	pending.pop_front();
+	currentIndex = 1;
+	
+	return &current->records[0];
+}
+
+void VcfReader::readBatch()
+{
+	shared_ptr<Batch> batch;
+	size_t bytes = 0;
+	
+	if ( spare.size() )
+	{
+		batch = spare.back();
+		spare.pop_back();
+	}
+	else
+	{
+		batch.reset(new Batch());
+		batch->records.resize(vcfBatchLines);
+	}
+	
+	batch->count = 0;
+	
+	while ( batch->count < vcfBatchLines && bytes < vcfBatchBytes && getline(in, batch->records[batch->count].line) )
+	{
+		batch->records[batch->count].lineIndex = lineIndex++;
+		bytes += batch->records[batch->count].line.length();
+		batch->count++;
+	}
+	
+	if ( batch->count == 0 )
+	{
+		end = true;
+		spare.push_back(batch);
+		return;
+	}
+	
+	pending.push_back(pool.submit([batch]()
+	{
+		for ( int i = 0; i < batch->count; i++ )
+		{
+			parseVcfRecord(batch->records[i]);
+		}
+		
+		return batch;
+	}));
+}
+
+static const int columnNone = -1;
+static const int columnAmbiguous = -2; // ambiguous indel; no variants allowed
+static const uint64_t columnKeyEmpty = ~(uint64_t)0;
+
+// (sequence, position, offset) in one word; sequences must be below 2^24
+// and offsets below 256
+//
+static uint64_t packColumnKey(int sequence, int position, int offset)
+{
+	return (uint64_t)sequence << 40 | (uint64_t)(uint32_t)position << 8 | offset;
+}
+
+// Open-addressing (linear probing) table from packed column keys to variant
+// indeces, or to columnAmbiguous. Entries are only ever added or changed, so
+// no tombstones are needed here.
+//
+class ColumnTable
+{
+public:
+
+	ColumnTable()
+	{
+		keys.assign(1 << 10, columnKeyEmpty);
+		values.resize(keys.size());
+		count = 0;
+	}
+	
+	int find(uint64_t key) const; // columnNone if absent
+	int & operator[](uint64_t key); // adds columnNone if absent
+
+private:
+
+	size_t getSlot(uint64_t key) const;
+	
+	vector<uint64_t> keys;
+	vector<int> values;
+	size_t count;
+};
+
+int ColumnTable::find(uint64_t key) const
+{
+	size_t slot = getSlot(key);
+	
+	return keys[slot] == key ? values[slot] : columnNone;
+}
+
+size_t ColumnTable::getSlot(uint64_t key) const
+{
+	// Fibonacci hashing spreads neighboring positions across the table
+	
+	size_t mask = keys.size() - 1;
+	size_t slot = (key * 0x9e3779b97f4a7c15ull) >> 32 & mask;
+	
+	while ( keys[slot] != key && keys[slot] != columnKeyEmpty )
+	{
+		slot = (slot + 1) & mask;
+	}
+	
+	return slot;
+}
+
+int & ColumnTable::operator[](uint64_t key)
+{
+	size_t slot = getSlot(key);
+	
+	if ( keys[slot] == key )
+	{
+		return values[slot];
+	}
+	
+	if ( 2 * (count + 1) > keys.size() )
+	{
+		// keep the load at most half
+		
+		vector<uint64_t> keysOld(keys.size() * 2, columnKeyEmpty);
+		vector<int> valuesOld(keysOld.size());
+		
+		keys.swap(keysOld);
+		values.swap(valuesOld);
+		
+		for ( size_t i = 0; i < keysOld.size(); i++ )
+		{
+			if ( keysOld[i] != columnKeyEmpty )
+			{
+				size_t slotNew = getSlot(keysOld[i]);
+				
+				keys[slotNew] = keysOld[i];
+				values[slotNew] = valuesOld[i];
+			}
+		}
+		
+		slot = getSlot(key);
+	}
+	
+	keys[slot] = key;
+	values[slot] = columnNone;
+	count++;
+	
+	return values[slot];
+}
+
+bool operator<(const VariantList::VariantSortKey & a, const VariantList::VariantSortKey & b)
+{
+	if ( a.sequence == b.sequence )
+	{
+		if ( a.position == b.position )
+		{
+			return a.offset < b.offset;
+		}
+		else
+		{
+			return a.position < b.position;
+		}
+	}
+	else
+	{
+		return a.sequence < b.sequence;
+	}
+}
+
+VariantList::VariantList()
+{
+	alleleCount = 0;
+	alleleStride = 0;
+	alleleBitsetsValid = false;
+	flagsExtraWords = 0;
+	filterBitmapsValid = false;
+	windowSize = windowSizeDefault;
+	windowConservation = windowConservationDefault;
+	windowGaps = windowGapsDefault;
+}
+
+VariantList::AlignmentCaller::AlignmentCaller(VariantList & variantListNew, const ReferenceList & referenceListNew, ThreadPool * poolNew)
+	: variantList(variantListNew), referenceList(referenceListNew), poolOwned(poolNew ? 0 : new ThreadPool()), pool(poolNew ? *poolNew : *poolOwned)
+{
+}
+
+VariantList::AlignmentCaller::~AlignmentCaller()
+{
+	finish();
+}
+
+void VariantList::AlignmentCaller::add(vector<string> & seqs, int sequence, int position, int length, bool reverse)
+{
+	shared_ptr<vector<string> > alignment(new vector<string>(seqs.size()));
+	vector<const char *> rows(seqs.size());
+	
+	for ( int i = 0; i < seqs.size(); i++ )
+	{
+		(*alignment)[i].swap(seqs[i]);
+		rows[i] = (*alignment)[i].data();
+	}
+	
+	add(rows, (*alignment)[0].length(), sequence, position, length, reverse, false, alignment);
+}
+
+void VariantList::AlignmentCaller::add(const vector<const char *> & rows, int columns, int sequence, int position, int length, bool reverse, bool uppercase, shared_ptr<void> owner)
+{
+	// bound the alignments held at once
+	
+	if ( pending.size() >= 2 * pool.getThreadCount() )
+	{
+		appendNext();
+	}
+	
+	const ReferenceList * references = &referenceList;
+	int windowSize = variantList.windowSize;
+	double windowConservation = variantList.windowConservation;
+	double windowGaps = variantList.windowGaps;
+	
+	// the task holds a copy of the owner, so the rows outlive it
+	
+	pending.push_back(pool.submit([=, ownerTask = owner]()
+	{
+		shared_ptr<VariantList> calls(new VariantList());
+		
+		calls->setWindowFilters(windowSize, windowConservation, windowGaps);
+		calls->addVariantsFromAlignment(rows.data(), rows.size(), columns, *references, sequence, position, length, reverse, uppercase);
+		
+		return calls;
+	}));
+}
+
+void VariantList::AlignmentCaller::appendNext()
+{
+	// kept until finish(), without the filters, which are the same
+	
+	shared_ptr<VariantList> calls = pending.front().get();
+	
+	pending.pop_front();
+	
+	if ( calls->getVariantCount() )
+	{
+		vector<Filter>().swap(calls->filters);
+		done.push_back(calls);
+	}
+}
+
+void VariantList::AlignmentCaller::finish()
+{
+	while ( pending.size() )
+	{
+		appendNext();
+	}
+	
+	variantList.addVariants(done, pool);
+	done.clear();
+}
+
+void VariantList::AlleleBitsets::build(const VariantList & variantList)
+{
+	int count = variantList.getAlleleCount();
+	vector<char> row(count);
+	int setByAllele[256]; // set of each allele in the current variant, or -1
+	
+	words = (count + 63) / 64;
+	nonReference.assign((size_t)variantList.getVariantCount() * words, 0);
+	setStarts.assign(1, 0);
+	setAlleles.clear();
+	sets.clear();
+	
+	for ( int i = 0; i < 256; i++ )
+	{
+		setByAllele[i] = -1;
+	}
+	
+	for ( int i = 0; i < variantList.getVariantCount(); i++ )
+	{
+		uint64_t * nonReferenceRow = nonReference.data() + (size_t)i * words;
+		char reference = variantList.references[i];
+		
+		variantList.getAlleles(i, row.data());
+		
+		for ( int j = 0; j < count; j++ )
+		{
+			unsigned char allele = row[j];
+			uint64_t bit = (uint64_t)1 << (j % 64);
+			
+			if ( setByAllele[allele] == -1 )
+			{
+				setByAllele[allele] = setAlleles.size();
+				setAlleles.push_back(allele);
+				sets.resize(sets.size() + words, 0);
+			}
+			
+			sets[(size_t)setByAllele[allele] * words + j / 64] |= bit;
+			
+			if ( row[j] != reference )
+			{
+				nonReferenceRow[j / 64] |= bit;
+			}
+		}
+		
+		for ( int j = setStarts[i]; j < setAlleles.size(); j++ )
+		{
+			setByAllele[(unsigned char)setAlleles[j]] = -1;
+		}
+		
+		setStarts.push_back(setAlleles.size());
+	}
+}
+
+const uint64_t * VariantList::AlleleBitsets::getBits(int index, char allele) const
+{
+	for ( int i = setStarts[index]; i < setStarts[index + 1]; i++ )
+	{
+		if ( setAlleles[i] == allele )
+		{
+			return sets.data() + (size_t)i * words;
+		}
+	}
+	
+	return 0;
+}
+
+bool VariantList::addFilterCountsFromCapnp(const capnp::Harvest::Reader & harvestReader, vector<uint64_t> & counts)
+{
+	// sums the counts stored with the bitmaps of a chunk without reading its
+	// variants; older files have no bitmaps to count
+	
+	capnp::Harvest::VariantList::Reader variantListReader = harvestReader.getVariantList();
+	
+	initFiltersFromCapnp(variantListReader);
+	
+	if ( ! variantListReader.hasFilterBitmaps() && variantListReader.getVariants().size() )
+	{
+		return false;
+	}
+	
+	counts.resize(filters.size());
+	
+	auto filterBitmapsReader = variantListReader.getFilterBitmaps();
+	
+	for ( int i = 0; i < filterBitmapsReader.size(); i++ )
+	{
+		int filter = filterBitmapsReader[i].getFilter();
+		
+		if ( filter >= filters.size() )
+		{
+			return false;
+		}
+		
+		counts[filter] += filterBitmapsReader[i].getCount();
+	}
+	
+	return true;
+}
+
+void VariantList::addFilterFromBed(const char * file, const char * name, const char * desc)
+{
+	BedFilter bed = {file, name, desc};
+	
+	addFiltersFromBed(vector<BedFilter>(1, bed));
+}
+
+void VariantList::addFiltersFromBed(const vector<BedFilter> & beds, const ReferenceList * referenceList)
+{
+	// Intervals from all files are combined into one index per sequence,
+	// which splits it at every interval boundary and records the filters
+	// covering each stretch. Variants then look up their stretch, so neither
+	// the files nor the variants need to be sorted, and the lookups are split
+	// across threads. Intervals are 1-based and inclusive. Sequences are
+	// given by reference name, or by 1-based index.
+	
+	map<string, int> sequencesByName;
+	vector<vector<BedBoundary> > boundaries;
+	
+	for ( int i = 0; referenceList && i < referenceList->getReferenceCount(); i++ )
+	{
+		sequencesByName[referenceList->getReference(i).name] = i;
+	}
+	
+	for ( int i = 0; i < beds.size(); i++ )
+	{
+		const BedFilter & bed = beds[i];
+		int filter = filters.size();
+		
+		addFilter(getFilterFlag(filter), bed.name, bed.description);
+		
+		InputStream in(bed.file.c_str());
+		string line;
+		
+		if ( ! in.is_open() )
+		{
+			cerr << "ERROR: " << bed.file << " could not be opened.\n";
+			continue;
+		}
+		
+		while ( getline(in, line) )
+		{
+			size_t tabStart = line.find('\t');
+			size_t tabEnd = tabStart == string::npos ? string::npos : line.find('\t', tabStart + 1);
+			
+			if ( tabEnd == string::npos )
+			{
+				continue;
+			}
+			
+			map<string, int>::const_iterator name = sequencesByName.find(line.substr(0, tabStart));
+			int sequence = name == sequencesByName.end() ? atoi(line.c_str()) - 1 : name->second;
+			int start = atoi(line.c_str() + tabStart + 1) - 1;
+			int end = atoi(line.c_str() + tabEnd + 1) - 1;
+			
+			if ( sequence < 0 || end < start )
+			{
+				continue;
+			}
+			
+			if ( sequence >= boundaries.size() )
+			{
+				boundaries.resize(sequence + 1);
+			}
+			
+			BedBoundary boundaryStart = {start, filter, 1};
+			BedBoundary boundaryEnd = {end + 1, filter, -1};
+			
+			boundaries[sequence].push_back(boundaryStart);
+			boundaries[sequence].push_back(boundaryEnd);
+		}
+	}
+	
+	vector<BedSegments> segments(boundaries.size());
+	vector<int> coverage(filters.size(), 0); // overlapping intervals per filter
+	int words = 1 + flagsExtraWords;
+	
+	for ( int i = 0; i < boundaries.size(); i++ )
+	{
+		vector<uint64_t> flagsCovering(words, 0);
+		
+		sort(boundaries[i].begin(), boundaries[i].end());
+		
+		for ( int j = 0; j < boundaries[i].size(); j++ )
+		{
+			const BedBoundary & boundary = boundaries[i][j];
+			int word = boundary.filter < 64 ? 0 : 1 + (boundary.filter - 64) / 64;
+			uint64_t bit = boundary.filter < 64 ? filters[boundary.filter].flag : (uint64_t)1 << ((boundary.filter - 64) % 64);
+			
+			coverage[boundary.filter] += boundary.change;
+			
+			if ( coverage[boundary.filter] )
+			{
+				flagsCovering[word] |= bit;
+			}
+			else
+			{
+				flagsCovering[word] &= ~bit;
+			}
+			
+			if ( j + 1 == boundaries[i].size() || boundaries[i][j + 1].position != boundary.position )
+			{
+				segments[i].starts.push_back(boundary.position);
+				segments[i].flags.insert(segments[i].flags.end(), flagsCovering.begin(), flagsCovering.end());
+			}
+		}
+	}
+	
+	ThreadPool pool;
+	vector<future<void> > results;
+	int chunkSize = max(1024, getVariantCount() / pool.getThreadCount() / 4 + 1);
+	
+	for ( int i = 0; i < getVariantCount(); i += chunkSize )
+	{
+		int end = min(i + chunkSize, getVariantCount());
+		
+		results.push_back(pool.submit([this, &segments, words, i, end]()
+		{
+			for ( int j = i; j < end; j++ )
+			{
+				if ( sequences[j] < 0 || sequences[j] >= segments.size() )
+				{
+					continue;
+				}
+				
+				const BedSegments & segmentsSequence = segments[sequences[j]];
+				int segment = upper_bound(segmentsSequence.starts.begin(), segmentsSequence.starts.end(), positions[j]) - segmentsSequence.starts.begin() - 1;
+				
+				if ( segment < 0 )
+				{
+					continue;
+				}
+				
+				const uint64_t * flagsSegment = segmentsSequence.flags.data() + (size_t)segment * words;
+				
+				flags[j] |= flagsSegment[0];
+				
+				for ( int k = 1; k < words; k++ )
+				{
+					flagsExtra[(size_t)j * flagsExtraWords + k - 1] |= flagsSegment[k];
+				}
+			}
+		}));
+	}
+	
+	for ( int i = 0; i < results.size(); i++ )
+	{
+		results[i].get();
+	}
+	
+	filterBitmapsValid = false;
+}
+
+void VariantList::addFilterFromProtocolBuffer(const Harvest::Variation::Filter & msgFilter)
+{
+	filters.resize(filters.size() + 1);
+	
+	Filter & filter = filters[filters.size() - 1];
+	
+	filter.flag = msgFilter.flag();
+	filter.name = msgFilter.name();
+	filter.description = msgFilter.description();
+	
+	updateFlagsExtraWords();
+}
+
+int VariantList::addVariant(int sequence, int position, int offset, char reference, const char * allelesNew, int length, long long int filtersNew, int quality)
+{
+	// The first variant sets the width of the allele matrix; columns always
+	// span all tracks, so others should match. Alleles are zeroed if not
+	// given.
+	
+	if ( getVariantCount() == 0 )
+	{
+		setAlleleCount(length);
+	}
+	
+	int index = getVariantCount();
+	
+	sequences.push_back(sequence);
+	positions.push_back(position);
+	offsets.push_back(offset);
+	references.push_back(reference);
+	flags.push_back(filtersNew);
+	flagsExtra.resize(flagsExtra.size() + flagsExtraWords, 0);
+	qualities.push_back(quality);
+	alleles.resize(alleles.size() + alleleStride, 0);
+	alleleBitsetsValid = false;
+	filterBitmapsValid = false;
+	
+	if ( allelesNew )
+	{
+		for ( int i = 0; i < min(length, alleleCount); i++ )
+		{
+			setAllele(index, i, allelesNew[i]);
+		}
+	}
+	
+	return index;
+}
+
+void VariantList::addVariants(const vector<shared_ptr<VariantList> > & variantLists, ThreadPool & pool)
+{
+	// The fields are resized once and each list is copied to its place on
+	// the pool, so nothing is moved as they grow. Allele rows have the same
+	// width, so only the keys of escapes move; they stay in order, so they
+	// are appended at the end of the map.
+	
+	vector<int> starts(variantLists.size() + 1, getVariantCount());
+	
+	for ( int i = 0; i < variantLists.size(); i++ )
+	{
+		if ( starts[i] == 0 && variantLists[i]->getVariantCount() )
+		{
+			setAlleleCount(variantLists[i]->alleleCount);
+		}
+		
+		starts[i + 1] = starts[i] + variantLists[i]->getVariantCount();
+	}
+	
+	if ( starts.back() == getVariantCount() )
+	{
+		return;
+	}
+	
+	resizeVariants(starts.back());
+	
+	vector<future<void> > results;
+	int chunkSize = variantLists.size() / pool.getThreadCount() / 4 + 1;
+	
+	for ( int i = 0; i < variantLists.size(); i += chunkSize )
+	{
+		int end = min(i + chunkSize, (int)variantLists.size());
+		
+		results.push_back(pool.submit([this, &variantLists, &starts, i, end]()
+		{
+			for ( int j = i; j < end; j++ )
+			{
+				const VariantList & variantList = *variantLists[j];
+				int start = starts[j];
+				
+				copy(variantList.sequences.begin(), variantList.sequences.end(), sequences.begin() + start);
+				copy(variantList.positions.begin(), variantList.positions.end(), positions.begin() + start);
+				copy(variantList.offsets.begin(), variantList.offsets.end(), offsets.begin() + start);
+				copy(variantList.references.begin(), variantList.references.end(), references.begin() + start);
+				copy(variantList.flags.begin(), variantList.flags.end(), flags.begin() + start);
+				copy(variantList.flagsExtra.begin(), variantList.flagsExtra.end(), flagsExtra.begin() + (size_t)start * flagsExtraWords);
+				copy(variantList.qualities.begin(), variantList.qualities.end(), qualities.begin() + start);
+				copy(variantList.alleles.begin(), variantList.alleles.end(), alleles.begin() + (size_t)start * alleleStride);
+			}
+		}));
+	}
+	
+	for ( int i = 0; i < results.size(); i++ )
+	{
+		results[i].get();
+	}
+	
+	for ( int i = 0; i < variantLists.size(); i++ )
+	{
+		uint64 start = (uint64)starts[i] * alleleCount;
+		
+		for ( map<uint64, char>::const_iterator j = variantLists[i]->alleleEscapes.begin(); j != variantLists[i]->alleleEscapes.end(); j++ )
+		{
+			alleleEscapes.insert(alleleEscapes.end(), make_pair(start + j->first, j->second));
+		}
+	}
+}
+
+void VariantList::addVariantFromProtocolBuffer(const Harvest::Variation::Variant & msgVariant)
+{
+	const string & msgAlleles = msgVariant.alleles();
+	
+	addVariant
+	(
+		msgVariant.sequence(),
+		msgVariant.position(),
+		0,
+		msgVariant.has_reference() ? msgVariant.reference() : msgAlleles[0],
+		msgAlleles.data(),
+		msgAlleles.length(),
+		msgVariant.filters(),
+		msgVariant.quality()
+	);
+}
+
+void VariantList::addVariantsFromAlignment(const vector<string> & seqs, const ReferenceList & referenceList, int sequence, int position, int length, bool reverse)
+{
+	vector<const char *> rows(seqs.size());
+	
+	for ( int j = 0; j < seqs.size(); j++ )
+	{
+		rows[j] = seqs[j].data();
+	}
+	
+	addVariantsFromAlignment(rows.data(), rows.size(), seqs[0].length(), referenceList, sequence, position, length, reverse);
+}
+
+void VariantList::addVariantsFromAlignment(const char * const * rows, int rowCount, int columns, const ReferenceList & referenceList, int sequence, int position, int length, bool reverse, bool uppercase)
+{
+//	Harvest::Variation * msg = harvest.mutable_variation();
+	int words = (columns + 63) / 64;
+	char col[rowCount + 1];
+	vector<uint64_t> variants(words);
+	vector<uint64_t> indels(words);
+	vector<uint64_t> nns(words);
+	int offset = 0;
+	
+	// conserved and gapped columns before each (in the order the block is
+	// read), so windows are counted by differences; the column past the end
+	// counts as conserved
+	//
+	vector<int> conservedSums(columns + 2, 0);
+	vector<int> gapSums(columns + 2, 0);
+	
+	col[rowCount] = 0; // null-terminate for use as a c-style string
+
+        //simple loop to check for column conservation
+        //this could be done via SP-score all-v-all pairs
+        //but for now, simply use to flag SNPs that are within a window of 100bp
+        //with less than 50% column conservation (w.r.t ref, not consensus)
+	//
+	// columns are scanned in stripes of 64 in the order of the rows, which
+	// reverse blocks read back to front
+	//
+	for ( int w = 0; w < words; w++ )
+	{
+		ColumnMasks masks;
+		int start = w * 64;
+		int count = min(64, columns - start);
+		
+		scanColumns(rows, rowCount, start, count, uppercase, masks);
+		
+		variants[w] = masks.variant;
+		indels[w] = masks.gap;
+		nns[w] = masks.n;
+		
+		for ( int k = 0; k < count; k++ )
+		{
+			int i = reverse ? columns - start - k - 1 : start + k;
+			
+			conservedSums[i + 1] = masks.conserved >> k & 1;
+			gapSums[i + 1] = masks.gap >> k & 1;
+		}
+	}
+	
+	conservedSums[columns + 1] = 1;
+	
+	for ( int i = 1; i <= columns + 1; i++ )
+	{
+		conservedSums[i] += conservedSums[i - 1];
+		gapSums[i] += gapSums[i - 1];
+	}
+	
+	// Since insertions to the reference take on the left-most reference
+	// position, this allows the alignment to start with an insertion
+	// (possibly at reference position -1).
+	//
+	position--;
+	
+	for ( int i = 0; i < columns; i++ )
+	{
+		int column = reverse ? columns - i - 1 : i;
+		bool variant = variants[column / 64] >> (column % 64) & 1;
+		bool indel = indels[column / 64] >> (column % 64) & 1;
+		bool n = nns[column / 64] >> (column % 64) & 1;
+		
+		if ( rows[0][column] == '-' )
+		{
+			// insertion relative to the reference
+			offset++;
+		}
+		else
+		{
+			position++;
+			offset = 0;
 		}
 		
 		if ( variant )
 		{
-			variants.resize(variants.size() + 1);
-			Variant * varNew = &variants[variants.size() - 1];
+			for ( int j = 0; j < rowCount; j++ )
+			{
+				col[j] = uppercase ? upperCase(rows[j][column]) : rows[j][column];
+			}
 			
 			while ( referenceList.getReferenceCount() > 0 && position >= 0 && position >= referenceList.getReference(sequence).sequence.length() )
 			{
@@ -220,102 +1409,73 @@ void VariantList::addVariantsFromAlignment(const vector<string> & seqs, const Re
 				sequence++;
 			}
 			
-			int windowsize = 0;
-                        int window = 50;
-                        if (window > i)
-			{
-			  window = i -1;
-			}
-                        windowsize+=window;
-                        int conserved_cnt = 0;
-                        int gap_cnt = 0;
-                        for (int z = 1; z<=window;z++)
-			{
-			  if (conserved.at(i-z))
-			  {
-			    conserved_cnt+=1;
-			  }
-
-			  if (gaps.at(i-z))
-			  {
-			    gap_cnt+=1;
-			  }
-            
-			}
-                        window = 50;
-                        if (window+i > seqs[0].length())
-			{
-			  window = seqs[0].length() - i;
-			}
-                        windowsize+=window;
-                        for (int z = 1; z<=window;z++)
+			// windows either side; near the start the left one also
+			// leaves out the first column (and is -1 wide at it)
+			//
+			int left = windowSize > i ? i - 1 : windowSize;
+			int right = windowSize + i > columns ? columns - i : windowSize;
+			int windowsize = left + right;
+			int conserved_cnt = conservedSums[i + right + 1] - conservedSums[i + 1];
+			int gap_cnt = gapSums[i + right + 1] - gapSums[i + 1];
+			
+			if ( left > 0 )
 			{
-			  if (conserved.at(i+z))
-			  {
-			    conserved_cnt+=1;
-			  }
-			  if (gaps.at(i+z))
-			  {
-			    gap_cnt+=1;
-			  }
+				conserved_cnt += conservedSums[i] - conservedSums[i - left];
+				gap_cnt += gapSums[i] - gapSums[i - left];
 			}
 			
 			if ( reverse )
 			{
-				for ( int j = 0; j < seqs.size(); j++ )
+				for ( int j = 0; j < rowCount; j++ )
 				{
 					col[j] = complement(col[j]);
 				}
 			}
 			
-			varNew->sequence = sequence;
-			varNew->position = position;
-			varNew->offset = offset;
+			char reference;
+			long long int filtersNew = 0;
 			
 			if ( referenceList.getReferenceCount() )
 			{
 				if ( offset > 0 )
 				{
-					varNew->reference = '-';
+					reference = '-';
 				}
 				else
 				{
-					varNew->reference = referenceList.getReference(sequence).sequence[position];
+					reference = referenceList.getReference(sequence).sequence[position];
 				}
 			}
 			else
 			{
-				varNew->reference = col[0];
+				reference = col[0];
 			}
 			
-			varNew->alleles = col;
-			varNew->filters = 0;
-			
 			if ( indel )
 			{
-				varNew->filters |= FILTER_indel;
+				filtersNew |= FILTER_indel;
 			}
 			
 			if ( n )
 			{
-				varNew->filters |= FILTER_n;
+				filtersNew |= FILTER_n;
 			}
 			
 			if ( length < 200 )
 			{
-				varNew->filters |= FILTER_lcb;
+				filtersNew |= FILTER_lcb;
 			}
 			
-                        if ( ((float)conserved_cnt/(float)windowsize) < 0.5 )
+                        if ( ((float)conserved_cnt/(float)windowsize) < windowConservation )
 			{
-				varNew->filters |= FILTER_conservation;
+				filtersNew |= FILTER_conservation;
 			}
-                        if ( ((float)gap_cnt/(float)windowsize) > 0.2 )
+                        if ( ((float)gap_cnt/(float)windowsize) > windowGaps )
 			{
-				varNew->filters |= FILTER_gaps;
+				filtersNew |= FILTER_gaps;
 			}
 			
-			varNew->quality = 0;
+			addVariant(sequence, position, offset, reference, col, rowCount, filtersNew, 0);
 		}
 	}
 }
@@ -323,7 +1483,225 @@ void VariantList::addVariantsFromAlignment(const vector<string> & seqs, const Re
 void VariantList::clear()
 {
 	filters.clear();
-	variants.clear();
+	clearVariants();
+}
+
+void VariantList::clearVariants()
+{
+	sequences.clear();
+	positions.clear();
+	offsets.clear();
+	references.clear();
+	flags.clear();
+	qualities.clear();
+	alleles.clear();
+	alleleEscapes.clear();
+	alleleCount = 0;
+	alleleStride = 0;
+	alleleBitsetsValid = false;
+	flagsExtra.clear();
+	flagsExtraWords = 0;
+	updateFlagsExtraWords();
+	filterBitmapsValid = false;
+}
+
+const VariantList::AlleleBitsets & VariantList::getAlleleBitsets() const
+{
+	if ( ! alleleBitsetsValid )
+	{
+		alleleBitsets.build(*this);
+		alleleBitsetsValid = true;
+	}
+	
+	return alleleBitsets;
+}
+
+const FilterBitmap & VariantList::getFilterBitmap(int filter) const
+{
+	if ( ! filterBitmapsValid )
+	{
+		filterBitmaps.assign(filters.size(), FilterBitmap());
+		
+		for ( int i = 0; i < getVariantCount(); i++ )
+		{
+			if ( ! getFiltered(i) )
+			{
+				continue;
+			}
+			
+			for ( int j = 0; j < filters.size(); j++ )
+			{
+				if ( getFiltered(i, j) )
+				{
+					filterBitmaps[j].add(i);
+				}
+			}
+		}
+		
+		filterBitmapsValid = true;
+	}
+	
+	return filterBitmaps.at(filter);
+}
+
+bool VariantList::getFiltered(int index, int filter) const
+{
+	if ( filters[filter].flag )
+	{
+		return flags[index] & filters[filter].flag;
+	}
+	
+	if ( filter < 64 )
+	{
+		return false;
+	}
+	
+	return flagsExtra[(size_t)index * flagsExtraWords + (filter - 64) / 64] >> ((filter - 64) % 64) & 1;
+}
+
+bool VariantList::getFilteredExtra(int index) const
+{
+	for ( int i = 0; i < flagsExtraWords; i++ )
+	{
+		if ( flagsExtra[(size_t)index * flagsExtraWords + i] )
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+char VariantList::getAlleleEscaped(int index, int track) const
+{
+	map<uint64, char>::const_iterator i = alleleEscapes.find((uint64)index * alleleCount + track);
+	
+	return i == alleleEscapes.end() ? 0 : i->second;
+}
+
+void VariantList::getAlleles(int index, char * allelesDecoded) const
+{
+	getAlleles(index, 0, alleleCount, allelesDecoded);
+}
+
+void VariantList::getAlleles(int index, int trackStart, int count, char * allelesDecoded) const
+{
+	uint64 start = (uint64)index * alleleCount + trackStart;
+	const uint8_t * row = alleles.data() + (size_t)index * alleleStride;
+	int i = 0;
+	
+	if ( trackStart % 2 && count )
+	{
+		allelesDecoded[0] = alleleSymbols[row[trackStart / 2] >> 4];
+		i = 1;
+	}
+	
+	decodeAlleles(row + (trackStart + i) / 2, count - i, allelesDecoded + i);
+	
+	for ( map<uint64, char>::const_iterator j = alleleEscapes.lower_bound(start); j != alleleEscapes.end() && j->first < start + count; j++ )
+	{
+		allelesDecoded[j->first - start] = j->second;
+	}
+}
+
+void VariantList::getSelection(const FilterExpression & expression, vector<bool> & selection) const
+{
+	// each filter named is gathered as a word of 64 variants, so the
+	// expression is evaluated for a word at a time
+	
+	const vector<int> & leaves = expression.getLeaves();
+	vector<uint64_t> words(leaves.size());
+	
+	selection.resize(getVariantCount());
+	
+	for ( int i = 0; i < getVariantCount(); i += 64 )
+	{
+		int count = min(64, getVariantCount() - i);
+		
+		for ( int j = 0; j < leaves.size(); j++ )
+		{
+			int filter = leaves[j];
+			uint64_t word = 0;
+			
+			if ( filter == -1 )
+			{
+				for ( int k = 0; k < count; k++ )
+				{
+					word |= (uint64_t)! getFiltered(i + k) << k;
+				}
+			}
+			else if ( filters[filter].flag )
+			{
+				uint64_t flag = filters[filter].flag;
+				
+				for ( int k = 0; k < count; k++ )
+				{
+					word |= (uint64_t)((flags[i + k] & flag) != 0) << k;
+				}
+			}
+			else
+			{
+				for ( int k = 0; k < count; k++ )
+				{
+					word |= (uint64_t)getFiltered(i + k, filter) << k;
+				}
+			}
+			
+			words[j] = word;
+		}
+		
+		uint64_t selected = expression.evaluate(words.data());
+		
+		for ( int k = 0; k < count; k++ )
+		{
+			selection[i + k] = selected >> k & 1;
+		}
+	}
+}
+
+void VariantList::getTrackAlleles(int variantStart, int variantCount, int trackStart, int trackCount, char * allelesTracks) const
+{
+	// rows are decoded a tile at a time and transposed into place
+	
+	char tile[alleleTile * alleleTile] = {0};
+	char tileTransposed[alleleTile * alleleTile];
+	
+	for ( int i = 0; i < variantCount; i += alleleTile )
+	{
+		int variants = min(alleleTile, variantCount - i);
+		
+		for ( int j = 0; j < trackCount; j += alleleTile )
+		{
+			int tracks = min(alleleTile, trackCount - j);
+			
+			for ( int k = 0; k < variants; k++ )
+			{
+				getAlleles(variantStart + i + k, trackStart + j, tracks, tile + k * alleleTile);
+			}
+			
+			transposeTile(tile, tileTransposed);
+			
+			for ( int k = 0; k < tracks; k++ )
+			{
+				memcpy(allelesTracks + (size_t)(j + k) * variantCount + i, tileTransposed + k * alleleTile, variants);
+			}
+		}
+	}
+}
+
+VariantList::Variant VariantList::getVariant(int index) const
+{
+	Variant variant;
+	
+	variant.sequence = sequences.at(index);
+	variant.position = positions[index];
+	variant.offset = offsets[index];
+	variant.reference = references[index];
+	variant.alleles = Alleles(this, index, alleleCount);
+	variant.filters = flags[index];
+	variant.quality = qualities[index];
+	
+	return variant;
 }
 
 void VariantList::init()
@@ -332,16 +1710,166 @@ void VariantList::init()
 	addFilter(FILTER_indel, "IND", "Column contains indel");
 	addFilter(FILTER_n, "N", "Column contains N");
 	addFilter(FILTER_lcb, "LCB", "LCB smaller than 200bp");
-	addFilter(FILTER_conservation, "CID", "SNP in aligned 100bp window with < 50% column % ID");
-	addFilter(FILTER_gaps, "ALN", "SNP in aligned 100b window with > 20 indels");
 	
-	variants.resize(0);
+	if ( windowSize == windowSizeDefault && windowConservation == windowConservationDefault && windowGaps == windowGapsDefault )
+	{
+		addFilter(FILTER_conservation, "CID", "SNP in aligned 100bp window with < 50% column % ID");
+		addFilter(FILTER_gaps, "ALN", "SNP in aligned 100b window with > 20 indels");
+	}
+	else
+	{
+		ostringstream conservation;
+		ostringstream gaps;
+		
+		conservation << "SNP in aligned " << windowSize * 2 << "bp window with < " << windowConservation * 100 << "% column % ID";
+		gaps << "SNP in aligned " << windowSize * 2 << "bp window with > " << windowGaps * 100 << "% gapped columns";
+		
+		addFilter(FILTER_conservation, "CID", conservation.str().c_str());
+		addFilter(FILTER_gaps, "ALN", gaps.str().c_str());
+	}
+	
+	clearVariants();
 }
 
-void VariantList::initFromCapnp(const capnp::Harvest::Reader & harvestReader)
+void VariantList::initFromCapnp(const capnp::Harvest::Reader & harvestReader, bool append)
 {
 	capnp::Harvest::VariantList::Reader variantListReader = harvestReader.getVariantList();
 	
+	// when appending (variants stored in chunks), the filters of each chunk
+	// are the same and simply replace the previous ones
+	
+	initFiltersFromCapnp(variantListReader);
+	
+	auto variantsReader = variantListReader.getVariants();
+	
+	if ( ! append )
+	{
+		clearVariants();
+	}
+	
+	updateFlagsExtraWords();
+	
+	int start = getVariantCount();
+	
+	// stored bitmaps stay valid if every chunk so far had them
+	
+	bool bitmapsValid = (start == 0 || filterBitmapsValid) && (variantListReader.hasFilterBitmaps() || variantsReader.size() == 0);
+	
+	if ( variantsReader.size() )
+	{
+		int alleleCountReserve = variantListReader.getAlleleCount() ? variantListReader.getAlleleCount() : variantsReader[0].getAlleles().size();
+		
+		reserveVariants(getVariantCount() + variantsReader.size(), alleleCountReserve);
+	}
+	
+	for ( int i = 0; i < variantsReader.size(); i++ )
+	{
+		capnp::Harvest::VariantList::Variant::Reader variantReader = variantsReader[i];
+		
+		if ( ! variantReader.hasAllelesPacked() )
+		{
+			// older files store alleles as text
+			
+			capnp::Text::Reader allelesReader = variantReader.getAlleles();
+			
+			addVariant
+			(
+				variantReader.getSequence(),
+				variantReader.getPosition(),
+				0,
+				variantReader.getReference(),
+				allelesReader.begin(),
+				allelesReader.size(),
+				variantReader.getFilters(),
+				variantReader.getQuality()
+			);
+			
+			continue;
+		}
+		
+		// packed rows are copied as they are; escapes are matched to their
+		// codes in order
+		
+		capnp::Data::Reader packedReader = variantReader.getAllelesPacked();
+		capnp::Text::Reader escapesReader = variantReader.getAlleleEscapes();
+		
+		int index = addVariant
+		(
+			variantReader.getSequence(),
+			variantReader.getPosition(),
+			0,
+			variantReader.getReference(),
+			0,
+			variantListReader.getAlleleCount(),
+			variantReader.getFilters(),
+			variantReader.getQuality()
+		);
+		
+		memcpy(alleles.data() + (size_t)index * alleleStride, packedReader.begin(), min(packedReader.size(), (size_t)alleleStride));
+		
+		int escape = 0;
+		
+		for ( int j = 0; j < alleleCount && escape < escapesReader.size(); j++ )
+		{
+			if ( getAlleleCode(index, j) == alleleEscape )
+			{
+				alleleEscapes[(uint64)index * alleleCount + j] = escapesReader[escape];
+				escape++;
+			}
+		}
+	}
+	
+	// Bitmaps index variants within the chunk, so they are offset by its
+	// start. Filters without a flag are only recorded in bitmaps.
+	
+	if ( start == 0 )
+	{
+		filterBitmaps.clear();
+	}
+	
+	filterBitmaps.resize(filters.size());
+	
+	auto filterBitmapsReader = variantListReader.getFilterBitmaps();
+	
+	for ( int i = 0; i < filterBitmapsReader.size(); i++ )
+	{
+		capnp::Harvest::VariantList::FilterBitmap::Reader filterBitmapReader = filterBitmapsReader[i];
+		int filter = filterBitmapReader.getFilter();
+		FilterBitmap bitmap;
+		vector<uint32_t> values;
+		
+		if ( filter >= filters.size() )
+		{
+			bitmapsValid = false;
+			continue;
+		}
+		
+		capnp::Data::Reader bitmapReader = filterBitmapReader.getBitmap();
+		
+		if ( ! bitmap.initFromData(bitmapReader.begin(), bitmapReader.size()) )
+		{
+			bitmapsValid = false;
+			continue;
+		}
+		
+		bitmap.getValues(values);
+		
+		for ( int j = 0; j < values.size() && values[j] < variantsReader.size(); j++ )
+		{
+			if ( ! filters[filter].flag )
+			{
+				setFiltered(start + values[j], filter);
+			}
+			
+			filterBitmaps[filter].add(start + values[j]);
+		}
+	}
+	
+	filterBitmapsValid = bitmapsValid;
+}
+
+void VariantList::initFiltersFromCapnp(const capnp::Harvest::VariantList::Reader & variantListReader)
+{
 	filters.resize(variantListReader.getFilters().size());
 	auto filtersReader = variantListReader.getFilters();
 	
@@ -355,75 +1883,41 @@ void VariantList::initFromCapnp(const capnp::Harvest::Reader & harvestReader)
 		
 		//printf("FILTER:\t%d\t%s\t%s\n", filters[i].flag, filters[i].name.c_str(), filters[i].description.c_str());
 	}
-	
-	variants.resize(variantListReader.getVariants().size());
-	auto variantsReader = variantListReader.getVariants();
-	
-	for ( int i = 0; i < variants.size(); i++ )
-	{
-		Variant & variant = variants[i];
-		capnp::Harvest::VariantList::Variant::Reader variantReader = variantsReader[i];
-		
-		variant.sequence = variantReader.getSequence();
-		variant.position = variantReader.getPosition();
-		variant.alleles = variantReader.getAlleles();
-		variant.filters = variantReader.getFilters();
-		variant.quality = variantReader.getQuality();
-		variant.reference = variantReader.getReference();
-		
-		//printf("VARIANT: %d\t%d\t%s\t%ld\t%d\n", variant.sequence, variant.position, variant.alleles.c_str(), variant.filters, variant.quality);
-	}
 }
 
 void VariantList::initFromProtocolBuffer(const Harvest::Variation & msgVariation)
 {
-	filters.resize(msgVariation.filters_size());
+	clear();
+	filters.reserve(msgVariation.filters_size());
 	
 	for ( int i = 0; i < msgVariation.filters_size(); i++ )
 	{
-//		cout << "Filter " << i << '\n';
-		filters[i].flag = msgVariation.filters(i).flag();
-		filters[i].name = msgVariation.filters(i).name();
-		filters[i].description = msgVariation.filters(i).description();
+		addFilterFromProtocolBuffer(msgVariation.filters(i));
 	}
 	
-	variants.resize(msgVariation.variants_size());
+	if ( msgVariation.variants_size() )
+	{
+		reserveVariants(msgVariation.variants_size(), msgVariation.variants(0).alleles().length());
+	}
 	
 	for ( int i = 0; i < msgVariation.variants_size(); i++ )
 	{
-//		cout << "Variant " << i << '\n';
-		Variant & variant = variants[i];
-		const Harvest::Variation::Variant & msgVariant = msgVariation.variants(i);
-		
-		variant.sequence = msgVariant.sequence();
-		variant.position = msgVariant.position();
-		variant.alleles = msgVariant.alleles();
-		variant.filters = msgVariant.filters();
-		variant.quality = msgVariant.quality();
-		
-		if ( msgVariant.has_reference() )
-		{
-			variant.reference = msgVariant.reference();
-		}
-		else
-		{
-			variant.reference = variant.alleles[0];
-		}
+		addVariantFromProtocolBuffer(msgVariation.variants(i));
 	}
 }
 
 void VariantList::initFromVcf(const char * file, const ReferenceList & referenceList, TrackList * trackList, LcbList * lcbList, PhylogenyTree * phylogenyTree)
 {
 	filters.resize(0);
-	variants.resize(0);
+	clearVariants();
 	
-	ifstream in(file);
+	InputStream in(file);
 	
 	// Since we will be transposing multi-base alleles to our column-based
 	// representation, we will refer to columns multiple times and will use a
-	// map to look up existing columns efficiently.
+	// hash table to look up existing columns efficiently.
 	//
-	map<VariantSortKey, int> variantIndecesBySortKey;
+	ColumnTable columns;
 	
 	// Insertions where any allele inserted more than one base are ambiguous and
 	// will be replaced with an LCB boundary; also, insertions or deletions with
@@ -434,14 +1928,35 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 	//
 	set<VariantSortKey> ambiguousIndels;
 	
-	string line;
+	// Variants at ambiguous indels are marked here rather than erased, which
+	// would move every later variant, and are removed once at the end.
+	//
+	vector<bool> erased;
+	
+	auto setAmbiguous = [&](int sequence, int position, int offset)
+	{
+		int & column = columns[packColumnKey(sequence, position, offset)];
+		
+		if ( column >= 0 )
+		{
+			erased[column] = true;
+		}
+		
+		column = columnAmbiguous;
+		ambiguousIndels.insert(VariantSortKey(sequence, position, offset));
+	};
+	
+	VcfReader reader(in);
+	const VcfRecord * record;
+	string refName;
+	string filterName;
 	map<string, long long int> flagsByFilter;
+	map<string, int> filtersExtraByName; // filters past 64, which have no flag
 	map<string, int> refByTag;
 	//unsigned int alleleCount = 0;
 	
 	const bool oldTags = phylogenyTree->getRoot();
 	int * trackIndecesNew;
-	int lineIndex = 1;
 	
 	if ( oldTags )
 	{
@@ -457,8 +1972,11 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 		refByTag[referenceList.getReference(i).name] = i;
 	}
 	
-	while ( getline(in, line) )
+	while ( (record = reader.next()) )
 	{
+		const string & line = record->line;
+		int lineIndex = record->lineIndex;
+		
 		if ( line[0] == '#' )
 		{
 			if ( strncmp(line.c_str(), "##FILTER", 8) == 0 )
@@ -486,9 +2004,15 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 					filter.description = line.substr(pos, end - pos);
 				}
 				
-				uint64 flag = 1 << flagsByFilter.size();
+				uint64 flag = getFilterFlag(flagsByFilter.size());
 				flagsByFilter[filter.name] = flag;
 				filter.flag = flag;
+				
+				if ( flag == 0 )
+				{
+					filtersExtraByName[filter.name] = filters.size() - 1;
+					updateFlagsExtraWords();
+				}
 				//printf("FILTER:\t%d\t%s\t%s\n", filter->flag(), filter->name().c_str(), filter->description().c_str());
 			}
 			else if ( strncmp(line.c_str(), "#CHROM", 6) == 0 )
@@ -535,64 +2059,43 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 				}
 			}
 		}
-		else
+		else if ( record->data )
 		{
-			stringstream lineStream(line);
-			
-			string refName;
-			int position;
-			string eaten;
-			string ref;
-			string altAlleles;
-			float quality;
-			string info;
-			string filterString;
-			int offset = 0;
-			
-			lineStream >> refName >> position >> eaten >> ref >> altAlleles >> quality >> filterString >> eaten >> eaten;
-			int sequence = refByTag[refName];
-			position--;
-			
-			vector<string> alleleStrings;
-			string alleleString;
-			stringstream alleleStream(altAlleles);
-			
-			while ( getline(alleleStream, alleleString, ',') )
-			{
-				alleleStrings.push_back(alleleString);
-			}
-			
-			uint64 filters = 0;
-			stringstream filterStream(filterString);
+			// tokenized by the reader (see parseVcfRecord())
 			
-			while ( getline(filterStream, filterString, ':') )
-			{
-				if ( filterString.compare(".") != 0 && filterString.compare("PASS") != 0 )
-				{
-					filters |= flagsByFilter[filterString];
-				}
-			}
+			const VcfField & ref = record->ref;
+			const vector<int> & alleleIndeces = record->alleleIndeces;
+			bool missing = record->missing;
+			float quality = record->quality;
 			
-			string alleleIndex;
-			vector<int> alleleIndeces;
-			bool missing = false;
+			refName.assign(record->chrom.text, record->chrom.length);
 			
-			while ( lineStream >> alleleIndex )
+			int sequence = refByTag[refName];
+			int position = record->position - 1;
+			
+			uint64 filters = 0;
+			vector<int> filtersExtra;
+			
+			for ( int i = 0; i < record->filters.size(); i++ )
 			{
-				if ( alleleIndex[0] == '.' )
-				{
-					missing = true;
-					alleleIndeces.push_back(-1);
-				}
-				else
+				filterName.assign(record->filters[i].text, record->filters[i].length);
+				
+				if ( filterName.compare(".") != 0 && filterName.compare("PASS") != 0 )
 				{
-					alleleIndeces.push_back(atoi(alleleIndex.c_str()));
+					filters |= flagsByFilter[filterName];
+					
+					if ( filtersExtraByName.count(filterName) )
+					{
+						filtersExtra.push_back(filtersExtraByName.at(filterName));
+					}
 				}
 			}
 			
-			for ( int i = 0; i < alleleStrings.size(); i++ )
+			for ( int i = 0; i < record->alts.size(); i++ )
 			{
-				if ( alleleStrings[i].find_first_of("<>[]*X") != string::npos )
+				const VcfField & alt = record->alts[i];
+				
+				if ( find_first_of(alt.text, alt.text + alt.length, "<>[]*X", "<>[]*X" + 6) != alt.text + alt.length )
 				{
 					// we don't yet handle symbolic alleles, breakends, or other
 					// weird stuff
@@ -600,9 +2103,9 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 					continue;
 				}
 				
-				if ( alleleStrings[i].length() != ref.length() )
+				if ( alt.length != ref.length )
 				{
-					if ( alleleStrings[i][0] != ref[0] )
+					if ( alt.text[0] != ref.text[0] )
 					{
 						throw CompoundVariantException(lineIndex);
 					}
@@ -610,18 +2113,18 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 				
 				int lengthVariant;
 				
-				if ( alleleStrings[i].length() > ref.length() )
+				if ( alt.length > ref.length )
 				{
-					lengthVariant = alleleStrings[i].length();
+					lengthVariant = alt.length;
 				}
 				else
 				{
-					lengthVariant = ref.length();
+					lengthVariant = ref.length;
 				}
 				
 				for ( int j = 0; j < lengthVariant; j++ )
 				{
-					if ( j < ref.length() && j < alleleStrings[i].length() && alleleStrings[i].at(j) == ref.at(j) )
+					if ( j < ref.length && j < alt.length && alt.text[j] == ref.text[j] )
 					{
 						continue;
 					}
@@ -629,10 +2132,10 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 					int positionVariant;
 					int offset;
 					
-					if ( j >= ref.length() )
+					if ( j >= ref.length )
 					{
-						positionVariant = position + ref.length() - 1;
-						offset = j - ref.length() + 1;
+						positionVariant = position + ref.length - 1;
+						offset = j - ref.length + 1;
 					}
 					else
 					{
@@ -642,7 +2145,7 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 					
 					if ( offset > 0 )
 					{
-						if ( ambiguousIndels.count(VariantSortKey(sequence, position + ref.length() - 1, 1)) )
+						if ( columns.find(packColumnKey(sequence, position + ref.length - 1, 1)) == columnAmbiguous )
 						{
 							// another variant tried to insert more than one
 							// base here; this is now ambiguous
@@ -657,97 +2160,74 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 						// replace with LCB boundary, destroy any single base
 						// insertions at this spot, and prevent more
 						
-						VariantSortKey key(sequence, position + ref.length() - 1, 1);
-						
-						if ( variantIndecesBySortKey.count(key) )
-						{
-							variants.erase(variants.begin() + variantIndecesBySortKey.at(key));
-						}
-						
-						ambiguousIndels.insert(key);
-						
+						setAmbiguous(sequence, position + ref.length - 1, 1);
 						break;
 					}
 					
-					VariantSortKey key(sequence, positionVariant, offset);
-					Variant * variant;
+					uint64_t key = packColumnKey(sequence, positionVariant, offset);
+					int variantIndex = columns.find(key);
 					
-					if ( ambiguousIndels.count(key) )
+					if ( variantIndex == columnAmbiguous )
 					{
 						// ambiguous deletion here; no variants allowed
 						
 						continue;
 					}
 					
-					if ( missing && j >= alleleStrings[i].length() )
+					if ( missing && j >= alt.length )
 					{
 						// ambiguous deletion; destroy any variants at this base
 						// (including insertions) and prevent more
 						
-						if ( variantIndecesBySortKey.count(key) )
-						{
-							variants.erase(variants.begin() + variantIndecesBySortKey.at(key));
-						}
-						
-						ambiguousIndels.insert(key);
-						
-						VariantSortKey keyInsertion(sequence, positionVariant, 1);
-						
-						if ( variantIndecesBySortKey.count(keyInsertion) )
-						{
-							variants.erase(variants.begin() + variantIndecesBySortKey.at(keyInsertion));
-						}
-						
-						ambiguousIndels.insert(keyInsertion);
-						
+						setAmbiguous(sequence, positionVariant, offset);
+						setAmbiguous(sequence, positionVariant, 1);
 						continue;
 					}
 					
-					if ( variantIndecesBySortKey.count(key) )
+					if ( variantIndex != columnNone )
 					{
 						// existing variant at this column
 						
-						variant = & variants[variantIndecesBySortKey.at(key)];
-						
 						// use the minimum quality to be conservative
 						//
-						if ( quality < variant->quality )
+						if ( quality < qualities[variantIndex] )
 						{
-							variant->quality = quality;
+							qualities[variantIndex] = quality;
 						}
 						
 						// use the union of the filters
 						//
-						variant->filters |= filters;
+						flags[variantIndex] |= filters;
+						filterBitmapsValid = false;
 					}
 					else
 					{
-						variantIndecesBySortKey[key] = variants.size();
-						variants.resize(variants.size() + 1);
-						variant = & variants[variants.size() - 1];
+						char reference;
 						
 						if ( offset )
 						{
-							variant->reference = '-';
+							reference = '-';
 						}
 						else
 						{
-							variant->reference = ref.at(j);
+							reference = ref.text[j];
 						}
 						
-						variant->sequence = sequence;
-						variant->position = positionVariant;
-						variant->offset = offset;
-						variant->quality = quality;
-						variant->filters = filters;
-						variant->alleles.resize(trackList->getTrackCount(), 0);
+						variantIndex = addVariant(sequence, positionVariant, offset, reference, 0, trackList->getTrackCount(), filters, quality);
+						columns[key] = variantIndex;
+						erased.push_back(false);
+					}
+					
+					for ( int k = 0; k < filtersExtra.size(); k++ )
+					{
+						setFiltered(variantIndex, filtersExtra[k]);
 					}
 					
 					char snp;
 					
-					if ( j < alleleStrings[i].length() )
+					if ( j < alt.length )
 					{
-						snp = alleleStrings[i].at(j);
+						snp = alt.text[j];
 					}
 					else
 					{
@@ -763,38 +2243,55 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 							
 							char snpAllele = alleleIndeces[k] == -1 ? 'N' : snp;
 							
-							if ( variant->alleles[k] != 0 && variant->alleles[k] != snpAllele)
+							char allele = getAllele(variantIndex, k);
+							
+							if ( allele != 0 && allele != snpAllele)
 							{
 								throw ConflictingVariantException
 								(
 									lineIndex,
 									trackList->getTrack(k).file,
-									variant->alleles[k],
+									allele,
 									snpAllele
 								);
 							}
 							
-							variant->alleles[k] = snpAllele;
+							setAllele(variantIndex, k, snpAllele);
 						}
 					}
 				}
 			}
 		}
-		
-		lineIndex++;
 	}
 	
+	int variantCount = 0;
+	
+	for ( int i = 0; i < getVariantCount(); i++ )
+	{
+		if ( ! erased[i] )
+		{
+			if ( i != variantCount )
+			{
+				moveVariant(i, variantCount);
+			}
+			
+			variantCount++;
+		}
+	}
+	
+	resizeVariants(variantCount);
+	
 	// since indel and snp changes can be cumulative in VCF, we only set
 	// alternate alleles above and will now fill in any missing values with
 	// their reference bases
 	//
-	for ( int i = 0; i < variants.size(); i++ )
+	for ( int i = 0; i < getVariantCount(); i++ )
 	{
-		for ( int j = 0; j < trackList->getTrackCount(); j++ )
+		for ( int j = 0; j < alleleCount; j++ )
 		{
-			if ( variants.at(i).alleles.at(j) == 0 )
+			if ( getAlleleCode(i, j) == 0 )
 			{
-				variants[i].alleles[j] = variants.at(i).reference;
+				setAllele(i, j, references[i]);
 			}
 		}
 	}
@@ -885,13 +2382,254 @@ void VariantList::initFromVcf(const char * file, const ReferenceList & reference
 	in.close();
 }
 
+void VariantList::moveVariant(int indexFrom, int indexTo)
+{
+	sequences[indexTo] = sequences[indexFrom];
+	positions[indexTo] = positions[indexFrom];
+	offsets[indexTo] = offsets[indexFrom];
+	references[indexTo] = references[indexFrom];
+	flags[indexTo] = flags[indexFrom];
+	copy(flagsExtra.begin() + (size_t)indexFrom * flagsExtraWords, flagsExtra.begin() + (size_t)(indexFrom + 1) * flagsExtraWords, flagsExtra.begin() + (size_t)indexTo * flagsExtraWords);
+	filterBitmapsValid = false;
+	qualities[indexTo] = qualities[indexFrom];
+	memmove(alleles.data() + (size_t)indexTo * alleleStride, alleles.data() + (size_t)indexFrom * alleleStride, alleleStride);
+	alleleBitsetsValid = false;
+	
+	if ( alleleEscapes.size() )
+	{
+		uint64 from = (uint64)indexFrom * alleleCount;
+		uint64 to = (uint64)indexTo * alleleCount;
+		
+		alleleEscapes.erase(alleleEscapes.lower_bound(to), alleleEscapes.lower_bound(to + alleleCount));
+		
+		for ( map<uint64, char>::const_iterator i = alleleEscapes.lower_bound(from); i != alleleEscapes.end() && i->first < from + alleleCount; i++ )
+		{
+			alleleEscapes[to + i->first - from] = i->second;
+		}
+	}
+}
+
+void VariantList::removeVariantsOutsideRange(int sequence, int start, int end)
+{
+	int j = 0;
+	
+	for ( int i = 0; i < getVariantCount(); i++ )
+	{
+		if ( sequences[i] == sequence && positions[i] >= start && positions[i] <= end )
+		{
+			if ( i != j )
+			{
+				moveVariant(i, j);
+			}
+			
+			j++;
+		}
+	}
+	
+	resizeVariants(j);
+}
+
+void VariantList::packAlleles(const char * allelesUnpacked, int count, string & packed, string & escapes)
+{
+	packed.assign((count + 1) / 2, 0);
+	escapes.clear();
+	
+	for ( int i = 0; i < count; i++ )
+	{
+		uint8_t code = alleleCodes.codes[(unsigned char)allelesUnpacked[i]];
+		
+		if ( code == alleleEscape )
+		{
+			escapes.push_back(allelesUnpacked[i]);
+		}
+		
+		packed[i / 2] |= code << (i % 2 * 4);
+	}
+}
+
+void VariantList::reserveVariants(int count, int alleleCountNew)
+{
+	sequences.reserve(count);
+	positions.reserve(count);
+	offsets.reserve(count);
+	references.reserve(count);
+	flags.reserve(count);
+	flagsExtra.reserve((size_t)count * flagsExtraWords);
+	qualities.reserve(count);
+	alleles.reserve((size_t)count * ((alleleCountNew + 1) / 2));
+}
+
+void VariantList::resizeVariants(int count)
+{
+	sequences.resize(count);
+	positions.resize(count);
+	offsets.resize(count);
+	references.resize(count);
+	flags.resize(count);
+	flagsExtra.resize((size_t)count * flagsExtraWords);
+	filterBitmapsValid = false;
+	qualities.resize(count);
+	alleles.resize((size_t)count * alleleStride);
+	alleleBitsetsValid = false;
+	alleleEscapes.erase(alleleEscapes.lower_bound((uint64)count * alleleCount), alleleEscapes.end());
+}
+
+void VariantList::setAllele(int index, int track, char allele)
+{
+	uint8_t code = alleleCodes.codes[(unsigned char)allele];
+	uint8_t & byte = alleles[(size_t)index * alleleStride + track / 2];
+	int shift = track % 2 * 4;
+	uint64 key = (uint64)index * alleleCount + track;
+	
+	if ( code == alleleEscape )
+	{
+		alleleEscapes[key] = allele;
+	}
+	else if ( (byte >> shift & 15) == alleleEscape )
+	{
+		alleleEscapes.erase(key);
+	}
+	
+	byte = (byte & ~(15 << shift)) | code << shift;
+	alleleBitsetsValid = false;
+}
+
+void VariantList::setFiltered(int index, int filter)
+{
+	if ( filters[filter].flag )
+	{
+		flags[index] |= filters[filter].flag;
+	}
+	else if ( filter >= 64 )
+	{
+		flagsExtra[(size_t)index * flagsExtraWords + (filter - 64) / 64] |= (uint64_t)1 << ((filter - 64) % 64);
+	}
+	
+	filterBitmapsValid = false;
+}
+
+void VariantList::setAlleleCount(int alleleCountNew)
+{
+	alleleCount = alleleCountNew;
+	alleleStride = (alleleCount + 1) / 2;
+}
+
+void VariantList::updateFlagsExtraWords()
+{
+	// widens the rows of flagsExtra to fit all filters
+	
+	int words = filters.size() > 64 ? (filters.size() - 64 + 63) / 64 : 0;
+	
+	if ( words <= flagsExtraWords )
+	{
+		return;
+	}
+	
+	vector<uint64_t> flagsExtraNew((size_t)getVariantCount() * words, 0);
+	
+	for ( int i = 0; i < getVariantCount(); i++ )
+	{
+		copy(flagsExtra.begin() + (size_t)i * flagsExtraWords, flagsExtra.begin() + (size_t)(i + 1) * flagsExtraWords, flagsExtraNew.begin() + (size_t)i * words);
+	}
+	
+	flagsExtra.swap(flagsExtraNew);
+	flagsExtraWords = words;
+}
+
+void VariantList::setWindowFilters(int size, double conservationMin, double gapsMax)
+{
+	windowSize = size;
+	windowConservation = conservationMin;
+	windowGaps = gapsMax;
+}
+
 void VariantList::sortVariants()
 {
-	sort(variants.begin(), variants.end(), variantLessThan);
+	// sort an index of the variants, then gather each field into its order
+	
+	vector<int> order(getVariantCount());
+	
+	for ( int i = 0; i < order.size(); i++ )
+	{
+		order[i] = i;
+	}
+	
+	sort(order.begin(), order.end(), [this](int a, int b)
+	{
+		if ( sequences[a] == sequences[b] )
+		{
+			if ( positions[a] == positions[b] )
+			{
+				return offsets[a] < offsets[b];
+			}
+			else
+			{
+				return positions[a] < positions[b];
+			}
+		}
+		else
+		{
+			return sequences[a] < sequences[b];
+		}
+	});
+	
+	reorder(sequences, order);
+	reorder(positions, order);
+	reorder(offsets, order);
+	reorder(references, order);
+	reorder(flags, order);
+	reorder(qualities, order);
+	
+	if ( flagsExtraWords )
+	{
+		vector<uint64_t> flagsExtraOrdered(flagsExtra.size());
+		
+		for ( int i = 0; i < order.size(); i++ )
+		{
+			copy(flagsExtra.begin() + (size_t)order[i] * flagsExtraWords, flagsExtra.begin() + (size_t)(order[i] + 1) * flagsExtraWords, flagsExtraOrdered.begin() + (size_t)i * flagsExtraWords);
+		}
+		
+		flagsExtra.swap(flagsExtraOrdered);
+	}
+	
+	filterBitmapsValid = false;
+	
+	vector<uint8_t> allelesOrdered(alleles.size());
+	
+	for ( int i = 0; i < order.size(); i++ )
+	{
+		memcpy(allelesOrdered.data() + (size_t)i * alleleStride, alleles.data() + (size_t)order[i] * alleleStride, alleleStride);
+	}
+	
+	alleles.swap(allelesOrdered);
+	alleleBitsetsValid = false;
+	
+	if ( alleleEscapes.size() )
+	{
+		vector<int> indecesNew(order.size());
+		map<uint64, char> escapes;
+		
+		for ( int i = 0; i < order.size(); i++ )
+		{
+			indecesNew[order[i]] = i;
+		}
+		
+		for ( map<uint64, char>::const_iterator i = alleleEscapes.begin(); i != alleleEscapes.end(); i++ )
+		{
+			escapes[(uint64)indecesNew[i->first / alleleCount] * alleleCount + i->first % alleleCount] = i->second;
+		}
+		
+		alleleEscapes.swap(escapes);
+	}
 }
 
-void VariantList::writeToCapnp(capnp::Harvest::Builder & harvestBuilder) const
+void VariantList::writeToCapnp(capnp::Harvest::Builder & harvestBuilder, int start, int count) const
 {
+	if ( count < 0 )
+	{
+		count = getVariantCount() - start;
+	}
+	
 	capnp::Harvest::VariantList::Builder variantListBuilder = harvestBuilder.initVariantList();
 	
 	capnp::List<capnp::Harvest::VariantList::Filter>::Builder filtersBuilder = variantListBuilder.initFilters(filters.size());
@@ -905,37 +2643,125 @@ void VariantList::writeToCapnp(capnp::Harvest::Builder & harvestBuilder) const
 		filterBuilder.setDescription(filters[i].description);
 	}
 	
-	capnp::List<capnp::Harvest::VariantList::Variant>::Builder variantsBuilder = variantListBuilder.initVariants(variants.size());
+	capnp::List<capnp::Harvest::VariantList::Variant>::Builder variantsBuilder = variantListBuilder.initVariants(count);
 	
-	for ( int i = 0; i < variants.size(); i++ )
+	variantListBuilder.setAlleleCount(alleleCount);
+	
+	for ( int i = 0; i < count; i++ )
 	{
 		capnp::Harvest::VariantList::Variant::Builder variantBuilder = variantsBuilder[i];
+		int index = start + i;
+		
+		variantBuilder.setSequence(sequences.at(index));
+		variantBuilder.setReference(references[index]);
+		variantBuilder.setPosition(positions[index]);
+		variantBuilder.setAllelesPacked(capnp::Data::Reader(alleles.data() + (size_t)index * alleleStride, alleleStride));
+		variantBuilder.setFilters(flags[index]);
+		
+		uint64 key = (uint64)index * alleleCount;
+		string escapes;
+		
+		for ( map<uint64, char>::const_iterator j = alleleEscapes.lower_bound(key); j != alleleEscapes.end() && j->first < key + alleleCount; j++ )
+		{
+			escapes.push_back(j->second);
+		}
+		
+		if ( escapes.length() )
+		{
+			variantBuilder.setAlleleEscapes(escapes);
+		}
+	}
+	
+	// bitmaps of the filters set in this range, so they can be counted
+	// without reading the variants
+	
+	vector<FilterBitmap> bitmaps(filters.size());
+	
+	for ( int i = 0; i < count; i++ )
+	{
+		if ( ! getFiltered(start + i) )
+		{
+			continue;
+		}
+		
+		for ( int j = 0; j < filters.size(); j++ )
+		{
+			if ( getFiltered(start + i, j) )
+			{
+				bitmaps[j].add(i);
+			}
+		}
+	}
+	
+	writeFilterBitmapsToCapnp(bitmaps, variantListBuilder);
+}
+
+void VariantList::writeFilterBitmapsToCapnp(const vector<FilterBitmap> & bitmaps, capnp::Harvest::VariantList::Builder & variantListBuilder)
+{
+	int bitmapCount = 0;
+	
+	for ( int i = 0; i < bitmaps.size(); i++ )
+	{
+		if ( bitmaps[i].getCount() )
+		{
+			bitmapCount++;
+		}
+	}
+	
+	capnp::List<capnp::Harvest::VariantList::FilterBitmap>::Builder filterBitmapsBuilder = variantListBuilder.initFilterBitmaps(bitmapCount);
+	string data;
+	
+	for ( int i = 0, j = 0; i < bitmaps.size(); i++ )
+	{
+		if ( bitmaps[i].getCount() == 0 )
+		{
+			continue;
+		}
 		
-		const Variant & variant = variants[i % variants.size()];
+		capnp::Harvest::VariantList::FilterBitmap::Builder filterBitmapBuilder = filterBitmapsBuilder[j++];
 		
-		variantBuilder.setSequence(variant.sequence);
-		variantBuilder.setReference(variant.reference);
-		variantBuilder.setPosition(variant.position);
-		variantBuilder.setAlleles(variant.alleles);
-		variantBuilder.setFilters(variant.filters);
+		bitmaps[i].writeToData(data);
+		filterBitmapBuilder.setFilter(i);
+		filterBitmapBuilder.setCount(bitmaps[i].getCount());
+		filterBitmapBuilder.setBitmap(capnp::Data::Reader((const kj::byte *)data.data(), data.length()));
 	}
 }
 
-void VariantList::writeToMfa(std::ostream &out, bool indels, const TrackList & trackList) const
+void VariantList::writeToMfa(std::ostream &out, bool indels, const TrackList & trackList, const FilterExpression * expression) const
 {
+	// tracks are decoded alleleTile at a time into track-major order, so
+	// each is written from contiguous memory
+	
 	int wrap = 80;
 	int col;
+	vector<char> allelesTracks;
+	vector<bool> selection;
+	
+	if ( expression )
+	{
+		getSelection(*expression, selection);
+	}
 	
 	for ( int i = 0; i < trackList.getTrackCount(); i++ )
 	{
 		const TrackList::Track & track = trackList.getTrack(i);
 		
+		if ( i % alleleTile == 0 )
+		{
+			int tracks = min(alleleTile, trackList.getTrackCount() - i);
+			
+			allelesTracks.resize((size_t)tracks * getVariantCount());
+			getTrackAlleles(0, getVariantCount(), i, tracks, allelesTracks.data());
+		}
+		
+		const char * allelesTrack = allelesTracks.data() + (size_t)(i % alleleTile) * getVariantCount();
+		
 		out << '>' << (track.file.length() ? track.file : track.name) << endl;
 		col = 0;
 		
-		for ( int j = 0; j < variants.size(); j++ )
+		for ( int j = 0; j < getVariantCount(); j++ )
 		{
-			if ( ! indels && variants.at(j).filters && variants.at(j).filters != FILTER_n )
+			if ( expression ? ! selection[j] : (! indels && ((flags[j] && flags[j] != FILTER_n) || getFilteredExtra(j))) )
 			{
 				continue;
 			}
@@ -948,7 +2774,7 @@ void VariantList::writeToMfa(std::ostream &out, bool indels, const TrackList & t
 				col = 1;
 			}
 			
-			out << variants.at(j).alleles[i];
+			out << allelesTrack[j];
 		}
 		
 		out << endl;
@@ -968,19 +2794,23 @@ void VariantList::writeToProtocolBuffer(Harvest * msg) const
 		msgFilter->set_description(filters[i].description);
 	}
 	
-	for ( int i = 0; i < variants.size(); i++ )
+	string allelesDecoded(alleleCount, 0);
+	
+	for ( int i = 0; i < getVariantCount(); i++ )
 	{
 		Harvest::Variation::Variant * variant = msgVar->add_variants();
 		
-		variant->set_sequence(variants[i].sequence);
-		variant->set_reference(variants[i].reference);
-		variant->set_position(variants[i].position);
-		variant->set_alleles(variants[i].alleles);
-		variant->set_filters(variants[i].filters);
+		getAlleles(i, &allelesDecoded[0]);
+		
+		variant->set_sequence(sequences[i]);
+		variant->set_reference(references[i]);
+		variant->set_position(positions[i]);
+		variant->set_alleles(allelesDecoded);
+		variant->set_filters(flags[i]);
 	}
 }
 
-void VariantList::writeToVcf(std::ostream &out, bool indels, const ReferenceList & referenceList, const AnnotationList & annotationList, const TrackList & trackList, const vector<int> & tracksFocus, bool signature) const
+void VariantList::writeToVcf(std::ostream &out, bool indels, const ReferenceList & referenceList, const AnnotationList & annotationList, const TrackList & trackList, const vector<int> & tracksFocus, bool signature, const FilterExpression * expression) const
 {
 	//tjt: Currently outputs SNPs, no indels
 	//tjt: next pass will add standard VCF output for indels, plus an attempt at qual vals
@@ -1040,20 +2870,60 @@ void VariantList::writeToVcf(std::ostream &out, bool indels, const ReferenceList
 	
 	out << '\n';
 	
+	// track selections are tested as bitsets of the tracks carrying each
+	// allele; plain exports just scan the alleles
+	
+	bool selection = tracks.size() != trackList.getTrackCount() || signature;
+	const AlleleBitsets * bitsets = selection ? &getAlleleBitsets() : 0;
+	int words = selection ? bitsets->getWordCount() : 0;
+	vector<uint64_t> tracksBits(words, 0);
+	vector<uint64_t> focusBits(words, 0);
+	
+	for ( int i = 0; selection && i < tracks.size(); i++ )
+	{
+		tracksBits[tracks[i] / 64] |= (uint64_t)1 << (tracks[i] % 64);
+	}
+	
+	for ( int i = 0; selection && i < tracksFocus.size(); i++ )
+	{
+		focusBits[tracksFocus[i] / 64] |= (uint64_t)1 << (tracksFocus[i] % 64);
+	}
+	
+	vector<bool> selected;
+	
+	if ( expression )
+	{
+		getSelection(*expression, selected);
+	}
+	
 	//now iterate over variants and output
-	for ( int j = 0; j < variants.size(); j++ )
+	for ( int j = 0; j < getVariantCount(); j++ )
 	{
-		const Variant & variant = variants.at(j);
+		if ( expression && ! selected[j] )
+		{
+			continue;
+		}
+		
+		const Variant variant = getVariant(j);
 
 		//no indels for now.. TODO: should this check outside the clade also?
 		bool indel = false;
 		//
-		for ( int i = 0; i < tracks.size(); i++ )
+		if ( selection )
 		{
-			if ( variant.alleles[tracks[i]] == indl )
+			const uint64_t * gaps = bitsets->getBits(j, indl);
+			
+			indel = gaps && bitsIntersect(gaps, tracksBits.data(), words);
+		}
+		else
+		{
+			for ( int i = 0; i < tracks.size(); i++ )
 			{
-				indel = true;
-				break;
+				if ( variant.alleles[tracks[i]] == indl )
+				{
+					indel = true;
+					break;
+				}
 			}
 		}
 		
@@ -1064,50 +2934,18 @@ void VariantList::writeToVcf(std::ostream &out, bool indels, const ReferenceList
 		
 		if ( tracks.size() != trackList.getTrackCount() )
 		{
-			// differential
-			
-			bool same = true;
-			
-			for ( int i = 1; i < tracks.size(); i++ )
-			{
-				if ( variant.alleles[tracks[i]] != variant.alleles[tracks[0]] )
-				{
-					same = false;
-					break;
-				}
-			}
+			// differential; the same if all tracks carry the allele of the first
 			
-			if ( same )
+			if ( tracks.size() == 0 || bitsContain(bitsets->getBits(j, variant.alleles[tracks[0]]), tracksBits.data(), words) )
 			{
 				continue;
 			}
 		}
 		else if ( signature )
 		{
-			bool pass[tracks.size()];
+			// the focus tracks must share an allele that no other track carries
 			
-			for ( int i = 0; i < tracks.size(); i++ )
-			{
-				pass[i] = variant.alleles[i] != variant.alleles[tracksFocus[0]];
-			}
-			
-			for ( int i = 0; i < tracksFocus.size(); i++ )
-			{
-				pass[tracksFocus[i]] = variant.alleles[tracksFocus[i]] == variant.alleles[tracksFocus[0]];
-			}
-			
-			bool isSignature = true;
-			
-			for ( int i = 0; i < tracks.size(); i++ )
-			{
-				if ( ! pass[i] )
-				{
-					isSignature = false;
-					break;
-				}
-			}
-			
-			if ( ! isSignature )
+			if ( ! bitsEqual(bitsets->getBits(j, variant.alleles[tracksFocus[0]]), focusBits.data(), words) )
 			{
 				continue;
 			}
@@ -1197,7 +3035,7 @@ void VariantList::writeToVcf(std::ostream &out, bool indels, const ReferenceList
 		{
 			const Filter & filter = filters.at(i);
 			
-			if ( variant.filters & filter.flag )
+			if ( getFiltered(j, i) )
 			{
 				if ( filterCount > 0 )
 				{
@@ -1292,4 +3130,6 @@ void VariantList::addFilter(long long int flag, string name, string description)
 	filters[filters.size() - 1].flag = flag;
 	filters[filters.size() - 1].name = name;
 	filters[filters.size() - 1].description = description;
+	
+	updateFlagsExtraWords();
 }
@@ -7,7 +7,11 @@
 #ifndef VariantList_h
 #define VariantList_h
 
+#include <deque>
+#include <map>
+#include <stdexcept>
 #include <vector>
+#include <stdint.h>
 #include "harvest/capnp/harvest.capnp.h"
 #include "harvest/pb/harvest.pb.h"
 #include "harvest/LcbList.h"
@@ -15,9 +19,31 @@
 #include "harvest/ReferenceList.h"
 #include "harvest/TrackList.h"
 #include "harvest/AnnotationList.h"
+#include "harvest/FilterBitmap.h"
+#include "harvest/ThreadPool.h"
+
+class FilterExpression;
 
 typedef long long unsigned int uint64;
 
+// Alleles are stored as 4-bit codes, two tracks per byte (low nibble first).
+// Anything else (lowercase, rarer IUPAC codes) is coded as an escape and
+// kept separately. Code 0 is an unset allele.
+//
+static const char alleleSymbols[16] = {0, 'A', 'C', 'G', 'T', '-', 'N', 'R', 'Y', 'S', 'W', 'K', 'M', 'B', 'D', 0};
+static const uint8_t alleleEscape = 15;
+
+// variants and tracks per tile when transposing alleles to track-major order
+//
+static const int alleleTile = 64;
+
+// columns on each side of variants called from alignments, and the fractions
+// of those columns that are conserved (CID below) or gapped (ALN above)
+//
+static const int windowSizeDefault = 50;
+static const double windowConservationDefault = 0.5;
+static const double windowGapsDefault = 0.2;
+
 static const std::map<std::string, std::string> translations =
 {
 	{"TTT", "F"},
@@ -165,13 +191,96 @@ public:
 		std::string description;
 	};
 	
+	// a BED file of intervals to flag with a new filter
+	//
+	struct BedFilter
+	{
+		std::string file;
+		std::string name;
+		std::string description;
+	};
+	
+	// Alleles of a variant, one per track; a view of a row of the allele
+	// matrix of its list.
+	//
+	class Alleles
+	{
+	public:
+		
+		Alleles() : list(0), index(0), count(0) {}
+		Alleles(const VariantList * listNew, int indexNew, size_t countNew) : list(listNew), index(indexNew), count(countNew) {}
+		
+		char operator[](size_t track) const;
+		char at(size_t track) const;
+		size_t length() const;
+	
+	private:
+		
+		const VariantList * list;
+		int index;
+		size_t count;
+	};
+	
+	// For each variant, bitsets (64 tracks per word) of the tracks differing
+	// from the reference and of the tracks carrying each allele, so track
+	// selections can be tested a word at a time.
+	//
+	class AlleleBitsets
+	{
+	public:
+	
+		void build(const VariantList & variantList);
+		const uint64_t * getBits(int index, char allele) const; // 0 if no track carries the allele
+		const uint64_t * getNonReference(int index) const;
+		int getWordCount() const;
+	
+	private:
+	
+		int words;
+		std::vector<uint64_t> nonReference; // words per variant
+		std::vector<int> setStarts; // first allele set of each variant, then the total
+		std::vector<char> setAlleles;
+		std::vector<uint64_t> sets; // words per allele set
+	};
+	
+	// Calls variants of alignments (see addVariantsFromAlignment()) on a
+	// thread pool while more are read, appending each to the list in the
+	// order added, so the list is the same as calling them in turn. The
+	// reference list must not change until finish().
+	//
+	class AlignmentCaller
+	{
+	public:
+	
+		AlignmentCaller(VariantList & variantListNew, const ReferenceList & referenceListNew, ThreadPool * poolNew = 0); // its own pool if none is given
+		~AlignmentCaller(); // finishes
+		
+		void add(std::vector<std::string> & seqs, int sequence, int position, int length, bool reverse = false); // takes the sequences, leaving them empty
+		void add(const std::vector<const char *> & rows, int columns, int sequence, int position, int length, bool reverse = false, bool uppercase = false, std::shared_ptr<void> owner = std::shared_ptr<void>()); // rows must last until finish() unless owner holds them
+		void finish();
+	
+	private:
+	
+		void appendNext();
+		
+		VariantList & variantList;
+		const ReferenceList & referenceList;
+		std::unique_ptr<ThreadPool> poolOwned;
+		ThreadPool & pool;
+		std::deque<std::future<std::shared_ptr<VariantList> > > pending; // in the order added
+		std::vector<std::shared_ptr<VariantList> > done; // appended together by finish()
+	};
+	
+	// Variants are stored by field, so getVariant() assembles one by value;
+	// its alleles are only valid until the list changes.
+	//
 	struct Variant
 	{
 		int sequence;
 		int position;
 		int offset;
 		char reference;
-		std::string alleles;
+		Alleles alleles;
 		long long int filters;
 		int quality;
 	};
@@ -220,22 +329,53 @@ public:
 		char snpNew;
 	};
 	
+	VariantList();
+	
+	bool addFilterCountsFromCapnp(const capnp::Harvest::Reader & harvestReader, std::vector<uint64_t> & counts); // false if the file has no bitmaps
 	void addFilterFromBed(const char * file, const char * name, const char * desc);
+	void addFiltersFromBed(const std::vector<BedFilter> & beds, const ReferenceList * referenceList = 0);
+	void addFilterFromProtocolBuffer(const Harvest::Variation::Filter & msgFilter);
+	void addVariants(const std::vector<std::shared_ptr<VariantList> > & variantLists, ThreadPool & pool); // same tracks and filters
+	void addVariantFromProtocolBuffer(const Harvest::Variation::Variant & msgVariant);
 	void addVariantsFromAlignment(const std::vector<std::string> & seqs, const ReferenceList & referenceList, int sequence, int position, int length, bool reverse = false);
+	void addVariantsFromAlignment(const char * const * rows, int rowCount, int columns, const ReferenceList & referenceList, int sequence, int position, int length, bool reverse = false, bool uppercase = false); // uppercase reads rows as if uppercased
 	void clear();
+	char getAllele(int index, int track) const;
+	const AlleleBitsets & getAlleleBitsets() const; // built on first use after changes
+	int getAlleleCount() const;
+	void getAlleles(int index, char * alleles) const;
+	void getAlleles(int index, int trackStart, int count, char * alleles) const;
 	const Filter & getFilter(int index) const;
+	const FilterBitmap & getFilterBitmap(int filter) const; // built on first use after changes
 	int getFilterCount() const;
-	const Variant & getVariant(int index) const;
+	bool getFiltered(int index) const; // by any filter
+	bool getFiltered(int index, int filter) const;
+	void getSelection(const FilterExpression & expression, std::vector<bool> & selection) const; // by variant
+	void getTrackAlleles(int variantStart, int variantCount, int trackStart, int trackCount, char * alleles) const; // track-major, variantCount per track
+	Variant getVariant(int index) const;
 	int getVariantCount() const;
 	void init();
-	void initFromCapnp(const capnp::Harvest::Reader & harvestReader);
+	void initFromCapnp(const capnp::Harvest::Reader & harvestReader, bool append = false);
 	void initFromProtocolBuffer(const Harvest::Variation & msgVariation);
 	void initFromVcf(const char * file, const ReferenceList & referenceList, TrackList * trackList, LcbList * lcbList, PhylogenyTree * phylogenyTree);
+	void removeVariantsOutsideRange(int sequence, int start, int end);
+	void setWindowFilters(int size, double conservationMin, double gapsMax); // before calling variants from alignments
 	void sortVariants();
-	void writeToMfa(std::ostream &out, bool indels, const TrackList & trackList) const;
+	void writeToMfa(std::ostream &out, bool indels, const TrackList & trackList, const FilterExpression * expression = 0) const;
 	void writeToProtocolBuffer(Harvest * harvest) const;
-	void writeToCapnp(capnp::Harvest::Builder & harvestBuilder) const;
-	void writeToVcf(std::ostream &out, bool indels, const ReferenceList & referenceList, const AnnotationList & annotationList, const TrackList & trackList, const std::vector<int> & tracks, bool signature = false) const;
+	void writeToCapnp(capnp::Harvest::Builder & harvestBuilder, int start = 0, int count = -1) const;
+	void writeToVcf(std::ostream &out, bool indels, const ReferenceList & referenceList, const AnnotationList & annotationList, const TrackList & trackList, const std::vector<int> & tracks, bool signature = false, const FilterExpression * expression = 0) const;
+	
+	static void packAlleles(const char * alleles, int count, std::string & packed, std::string & escapes);
+	static void writeFilterBitmapsToCapnp(const std::vector<FilterBitmap> & bitmaps, capnp::Harvest::VariantList::Builder & variantListBuilder); // by filter, skipping empty ones
+	
+	// orders (sequence, position) like variantLessThan; used to index chunks of
+	// variants by region
+	//
+	static uint64 getPositionKey(int sequence, int position)
+	{
+		return (uint64)sequence << 32 | (unsigned int)position;
+	}
 	
 	static bool variantLessThan(const Variant & a, const Variant & b)
 	{
@@ -268,14 +408,92 @@ private:
 	};
 	
 	void addFilter(long long int flag, std::string name, std::string description);
+	int addVariant(int sequence, int position, int offset, char reference, const char * allelesNew, int length, long long int filtersNew, int quality);
+	void clearVariants();
+	bool getFilteredExtra(int index) const;
+	uint8_t getAlleleCode(int index, int track) const;
+	char getAlleleEscaped(int index, int track) const;
+	void initFiltersFromCapnp(const capnp::Harvest::VariantList::Reader & variantListReader);
+	void moveVariant(int indexFrom, int indexTo);
+	void reserveVariants(int count, int alleleCountNew);
+	void resizeVariants(int count);
+	void setAllele(int index, int track, char allele);
+	void setAlleleCount(int alleleCountNew);
+	void setFiltered(int index, int filter);
+	void updateFlagsExtraWords();
+	
+	static long long int getFilterFlag(int filter);
 	
 	std::vector<Filter> filters;
-	std::vector<Variant> variants;
+	
+	// Filters past the 64 bits of a flag have none; they are set in rows of
+	// flagsExtraWords for each variant instead (filter 64 is bit 0).
+	// Bitmaps of the variants with each filter are built from both, or
+	// read with the variants from Gingr files that store them.
+	//
+	std::vector<uint64_t> flagsExtra;
+	int flagsExtraWords;
+	mutable std::vector<FilterBitmap> filterBitmaps;
+	mutable bool filterBitmapsValid;
+	
+	// Variant fields are stored in parallel vectors, and the alleles in a
+	// single packed matrix with a row of alleleStride bytes (alleleCount
+	// codes) for each variant, so scans over either touch contiguous memory.
+	// Escaped alleles are keyed by variant index * alleleCount + track.
+	//
+	std::vector<int> sequences;
+	std::vector<int> positions;
+	std::vector<int> offsets;
+	std::vector<char> references;
+	std::vector<long long int> flags;
+	std::vector<int> qualities;
+	std::vector<uint8_t> alleles;
+	std::map<uint64, char> alleleEscapes;
+	int alleleCount;
+	int alleleStride;
+	
+	mutable AlleleBitsets alleleBitsets;
+	mutable bool alleleBitsetsValid;
+	
+	int windowSize;
+	double windowConservation;
+	double windowGaps;
 };
 
+inline char VariantList::Alleles::operator[](size_t track) const { return list->getAllele(index, track); }
+
+inline char VariantList::Alleles::at(size_t track) const
+{
+	if ( track >= count )
+	{
+		throw std::out_of_range("VariantList::Alleles::at");
+	}
+	
+	return list->getAllele(index, track);
+}
+
+inline size_t VariantList::Alleles::length() const { return count; }
+
+inline const uint64_t * VariantList::AlleleBitsets::getNonReference(int index) const { return nonReference.data() + (size_t)index * words; }
+inline int VariantList::AlleleBitsets::getWordCount() const { return words; }
+
+inline char VariantList::getAllele(int index, int track) const
+{
+	uint8_t code = getAlleleCode(index, track);
+	
+	return code == alleleEscape ? getAlleleEscaped(index, track) : alleleSymbols[code];
+}
+
+inline uint8_t VariantList::getAlleleCode(int index, int track) const
+{
+	return alleles[(size_t)index * alleleStride + track / 2] >> (track % 2 * 4) & 15;
+}
+
+inline int VariantList::getAlleleCount() const { return alleleCount; }
 inline const VariantList::Filter & VariantList::getFilter(int index) const { return filters.at(index); }
 inline int VariantList::getFilterCount() const { return filters.size(); }
-inline const VariantList::Variant & VariantList::getVariant(int index) const { return variants.at(index); }
-inline int VariantList::getVariantCount() const { return variants.size(); }
+inline bool VariantList::getFiltered(int index) const { return flags[index] || getFilteredExtra(index); }
+inline long long int VariantList::getFilterFlag(int filter) { return filter < 64 ? (long long int)1 << filter : 0; }
+inline int VariantList::getVariantCount() const { return sequences.size(); }
 
 #endif
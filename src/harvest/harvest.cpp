@@ -7,7 +7,12 @@
 #include <iostream>
 #include <fstream>
 #include "harvest/HarvestIO.h"
+#include "harvest/FilterExpression.h"
 #include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 #include "harvest/exceptions.h"
 
 using namespace::std;
@@ -54,6 +59,203 @@ void parseTracks(char * arg, vector<string> & tracks, bool & lca)
 	}
 }
 
+void parseCodec(char * arg, BlockCodec & codec, int & level)
+{
+	char * name = strtok(arg, ":");
+	char * levelString = strtok(0, "");
+	
+	level = blockLevelDefault;
+	
+	if ( name == 0 )
+	{
+		name = arg;
+	}
+	
+	if ( strcmp(name, "none") == 0 )
+	{
+		codec = CODEC_none;
+	}
+	else if ( strcmp(name, "zlib") == 0 )
+	{
+		codec = CODEC_zlib;
+	}
+	else if ( strcmp(name, "zstd") == 0 )
+	{
+		codec = CODEC_zstd;
+	}
+	else if ( strcmp(name, "lz4") == 0 )
+	{
+		codec = CODEC_lz4;
+	}
+	else
+	{
+		cerr << "ERROR: Unknown codec (\"" << name << "\")." << endl;
+		exit(1);
+	}
+	
+	if ( ! isCodecAvailable(codec) )
+	{
+		cerr << "ERROR: harvesttools was built without " << name << " support." << endl;
+		exit(1);
+	}
+	
+	if ( levelString )
+	{
+		// checked here, since a bad level would otherwise only fail once the
+		// output is being written
+		
+		char * end;
+		long levelParsed = strtol(levelString, &end, 10);
+		int min;
+		int max;
+		
+		if ( ! getCodecLevelRange(codec, min, max) )
+		{
+			cerr << "ERROR: The " << name << " codec does not take a level." << endl;
+			exit(1);
+		}
+		
+		if ( *levelString == 0 || *end != 0 || levelParsed < min || levelParsed > max )
+		{
+			cerr << "ERROR: Bad level for " << name << " (\"" << levelString << "\"; must be from " << min << " to " << max << ")." << endl;
+			exit(1);
+		}
+		
+		level = levelParsed;
+	}
+}
+
+void parseRegion(const char * arg, const ReferenceList & referenceList, int & sequence, int & start, int & end)
+{
+	// <name>:<start>-<end>, 1-based and inclusive; the name can contain ':'
+	
+	const char * colon = strrchr(arg, ':');
+	
+	if ( colon == 0 || sscanf(colon + 1, "%d-%d", &start, &end) != 2 || start < 1 || end < start )
+	{
+		cerr << "ERROR: Region must be <sequence>:<start>-<end> (\"" << arg << "\")." << endl;
+		exit(1);
+	}
+	
+	sequence = referenceList.getReferenceSequenceFromName(string(arg, colon - arg));
+	start--;
+	end--;
+}
+
+void parseWindow(const char * arg, int & size, double & conservation, double & gaps)
+{
+	// <size>[,<conservation>[,<gaps>]]; omitted fractions keep their defaults
+	
+	int fields = sscanf(arg, "%d,%lf,%lf", &size, &conservation, &gaps);
+	
+	if ( fields < 1 || size < 1 || conservation < 0 || conservation > 1 || gaps < 0 || gaps > 1 )
+	{
+		cerr << "ERROR: Window must be <size>[,<min conserved>[,<max gaps>]] (\"" << arg << "\")." << endl;
+		exit(1);
+	}
+}
+
+int upgrade(const char * input, const char * output, BlockCodec codec, int level, bool packed, bool quiet)
+{
+	// A single file, or every protocol buffer Gingr file in a directory,
+	// upgraded concurrently under the thread count.
+	
+	struct stat statInput;
+	
+	if ( stat(input, &statInput) != 0 )
+	{
+		cerr << "ERROR: could not read " << input << "." << endl;
+		return 1;
+	}
+	
+	if ( ! S_ISDIR(statInput.st_mode) )
+	{
+		if ( ! quiet ) cerr << "Upgrading " << input << "..." << endl;
+		return HarvestIO::upgradeHarvest(input, output, codec, level, packed) ? 0 : 1;
+	}
+	
+	mkdir(output, 0755);
+	
+	char pathInput[PATH_MAX];
+	char pathOutput[PATH_MAX];
+	
+	if ( realpath(input, pathInput) == 0 || realpath(output, pathOutput) == 0 )
+	{
+		cerr << "ERROR: could not open " << output << " for writing." << endl;
+		return 1;
+	}
+	
+	if ( strcmp(pathInput, pathOutput) == 0 )
+	{
+		cerr << "ERROR: Upgrade output directory must differ from input directory." << endl;
+		return 1;
+	}
+	
+	DIR * dir = opendir(input);
+	
+	if ( dir == 0 )
+	{
+		cerr << "ERROR: could not read " << input << "." << endl;
+		return 1;
+	}
+	
+	ThreadPool pool;
+	vector<string> files;
+	vector<future<bool> > results;
+	struct dirent * entry;
+	
+	while ( (entry = readdir(dir)) != 0 )
+	{
+		string fileInput = string(input) + "/" + entry->d_name;
+		struct stat statFile;
+		
+		if ( entry->d_name[0] == '.' || stat(fileInput.c_str(), &statFile) != 0 || ! S_ISREG(statFile.st_mode) )
+		{
+			continue;
+		}
+		
+		char header[blockHeaderLength] = {0};
+		ifstream in(fileInput.c_str());
+		
+		in.read(header, blockHeaderLength);
+		in.close();
+		
+		if ( strncmp(header, capnpHeader, capnpHeaderLength) == 0 )
+		{
+			if ( ! quiet ) cerr << "Skipping " << fileInput << " (already Cap'n Proto)." << endl;
+			continue;
+		}
+		
+		string fileOutput = string(output) + "/" + entry->d_name;
+		
+		files.push_back(fileInput);
+		results.push_back(pool.submit([fileInput, fileOutput, codec, level, packed]()
+		{
+			return HarvestIO::upgradeHarvest(fileInput.c_str(), fileOutput.c_str(), codec, level, packed);
+		}));
+	}
+	
+	closedir(dir);
+	
+	int failures = 0;
+	
+	for ( int i = 0; i < results.size(); i++ )
+	{
+		if ( results[i].get() )
+		{
+			if ( ! quiet ) cerr << "Upgraded " << files[i] << "." << endl;
+		}
+		else
+		{
+			failures++;
+		}
+	}
+	
+	if ( ! quiet ) cerr << "Upgraded " << results.size() - failures << " of " << results.size() << " files." << endl;
+	
+	return failures ? 1 : 0;
+}
+
 static const char * version = "1.3";
 
 int main(int argc, char * argv[])
@@ -80,11 +282,24 @@ int main(int argc, char * argv[])
 	bool signature = false;
 	const char * outBB = 0;
 	const char * outXmfa = 0;
+	const char * select = 0;
+	const char * region = 0;
+	const char * upgradeInput = 0;
+	const char * upgradeOutput = 0;
 	bool help = false;
 	bool updateBranchVals = false;
 	bool clearMult = false;
 	bool quiet = false;
 	bool midpointReroot = false;
+	bool filterCounts = false;
+	bool filterCountsStored = false;
+	vector<uint64_t> filterCountsLoaded;
+	int windowSize = windowSizeDefault;
+	double windowConservation = windowConservationDefault;
+	double windowGaps = windowGapsDefault;
+	BlockCodec codec = CODEC_zlib;
+	int codecLevel = blockLevelDefault;
+	bool packed = false;
 	
 	//stdout flag
 	string out1("-");
@@ -105,6 +320,36 @@ int main(int argc, char * argv[])
 					{
 						midpointReroot = true;
 					}
+					else if ( strcmp(argv[i], "--filter-counts") == 0 )
+					{
+						filterCounts = true;
+					}
+					else if ( strcmp(argv[i], "--uncompressed") == 0 )
+					{
+						codec = CODEC_none;
+						codecLevel = blockLevelDefault;
+					}
+					else if ( strcmp(argv[i], "--codec") == 0 )
+					{
+						parseCodec(argv[++i], codec, codecLevel);
+					}
+					else if ( strcmp(argv[i], "--packed") == 0 )
+					{
+						packed = true;
+					}
+					else if ( strcmp(argv[i], "--window") == 0 )
+					{
+						parseWindow(argv[++i], windowSize, windowConservation, windowGaps);
+					}
+					else if ( strcmp(argv[i], "--region") == 0 )
+					{
+						region = argv[++i];
+					}
+					else if ( strcmp(argv[i], "--upgrade") == 0 )
+					{
+						upgradeInput = argv[++i];
+						upgradeOutput = argv[++i];
+					}
 					else if ( strcmp(argv[i], "--internal") == 0 )
 					{
 						parseTracks(argv[++i], tracks, lca);
@@ -123,6 +368,7 @@ int main(int argc, char * argv[])
 				case 'a': maf = argv[++i]; break;
 				case 'b': bed.push_back(argv[++i]); break;
 				case 'B': outBB = argv[++i]; break;
+				case 'e': select = argv[++i]; break;
 				case 'f': fasta = argv[++i]; break;
 				case 'F': outFasta = argv[++i]; break;
 				case 'g': genbank.push_back(argv[++i]); break;
@@ -136,6 +382,7 @@ int main(int argc, char * argv[])
 				case 'o': output = argv[++i]; break;
 				case 'q': quiet = true; break;
 				case 'S': outSnp = argv[++i]; break;
+				case 't': ThreadPool::setDefaultThreadCount(atoi(argv[++i])); break;
 				case 'u':
 					//updateBranchVals = argv[++i];
 					if ( strcmp(argv[++i], "0") == 0 )
@@ -165,6 +412,10 @@ int main(int argc, char * argv[])
 		cout << "   -i <Gingr input>" << endl;
 		cout << "   -b <bed filter intervals>,<filter name>,\"<description>\"" << endl;
 		cout << "   -B <output backbone intervals>" << endl;
+		cout << "   --filter-counts (print the number of variants with each filter)" << endl;
+		cout << "   -e \"<filter expression>\" (only output variants for which it is true, e.g." << endl;
+		cout << "                              \"!IND & !CID & (LCB | PHAGE)\"; applies to -S, -V, -M, -I" << endl;
+		cout << "                              and -X; PASS is true for unfiltered variants)" << endl;
 		cout << "   -f <reference fasta>" << endl;
 		cout << "   -F <reference fasta out>" << endl;
 		cout << "   -g <reference genbank>" << endl;
@@ -176,7 +427,16 @@ int main(int argc, char * argv[])
 		cout << "   -N <Newick tree output>" << endl;
 		cout << "   --midpoint-reroot (reroot the tree at its midpoint after loading)" << endl;
 		cout << "   -o <Gingr output>" << endl;
+		cout << "   --codec <zlib|zstd|lz4|none>[:<level>] (compression for Gingr output; default: zlib)" << endl;
+		cout << "   --uncompressed (same as --codec none; Gingr output is memory-mapped when loaded)" << endl;
+		cout << "   --packed (pack Gingr output with Cap'n Proto packing before compression)" << endl;
+		cout << "   --region <sequence>:<start>-<end> (only load Gingr input variants in this region;" << endl;
+		cout << "                                      applies to -S, -V and --filter-counts)" << endl;
+		cout << "   --upgrade <input> <output> (convert a protocol buffer Gingr file, or a" << endl;
+		cout << "                               directory of them, to the current format)" << endl;
 		cout << "   -S <output for multi-fasta SNPs>" << endl;
+		cout << "   -t <threads> (for compressing, decompressing and upgrading Gingr files, reading" << endl;
+		cout << "                 bgzipped text input and calling variants; default: all cores)" << endl;
 		cout << "   -u 0/1 (update the branch values to reflect genome length)" << endl;
 		cout << "   -v <VCF input>" << endl;
 		cout << "   -V <VCF output>" << endl;
@@ -188,18 +448,146 @@ int main(int argc, char * argv[])
 		cout << "     --signature <track1>:<track2>     #only signature variants of LCA clade of" << endl;
 		cout << "                                        <track1> and <track2>" << endl;
 		cout << "   -x <xmfa alignment file>" << endl;
+		cout << "   --window <size>[,<min conserved>[,<max gaps>]] (columns on each side of variants" << endl;
+		cout << "                               called from alignments, and the fractions of them that" << endl;
+		cout << "                               set CID and ALN; default: 50,0.5,0.2)" << endl;
 		cout << "   -X <output xmfa alignment file>" << endl;
 		cout << "   -h (show this help)" << endl;
 		cout << "   -q (quiet mode)" << endl;
+		cout << "Text inputs (-f, -g, -a, -m, -n, -v, -x, -b) may be gzipped or bgzipped." << endl;
 		exit(0);
 	}
 	
+	if ( upgradeInput )
+	{
+		return upgrade(upgradeInput, upgradeOutput, codec, codecLevel, packed, quiet);
+	}
+	
+	if ( region && ! input )
+	{
+		cerr << "ERROR: --region requires a Gingr input (-i)." << endl;
+		return 1;
+	}
+	
+	if ( region && (outMfa || outMfaFiltered || outXmfa || output || updateBranchVals) )
+	{
+		// these would keep whole LCBs but only the variants in the region
+		
+		cerr << "ERROR: --region only applies to -S, -V and --filter-counts, not to -M, -I, -X, -o or -u." << endl;
+		return 1;
+	}
+	
 	HarvestIO hio;
 	
+	hio.variantList.setWindowFilters(windowSize, windowConservation, windowGaps);
+	
 	if ( input )
 	{
+		// only decode the sections the requested outputs need
+		
+		int sections = 0;
+		
+		if ( output || mfa || fasta || maf || genbank.size() || xmfa || newick || vcf )
+		{
+			sections = SECTION_all;
+		}
+		
+		if ( bed.size() )
+		{
+			sections |= SECTION_references | SECTION_variants; // BED sequences may be named
+		}
+		
+		if ( select )
+		{
+			sections |= SECTION_variants;
+		}
+		
+		if ( midpointReroot || clearMult )
+		{
+			sections |= SECTION_tree;
+		}
+		
+		if ( updateBranchVals )
+		{
+			sections |= SECTION_tree | SECTION_lcbs | SECTION_variants;
+		}
+		
+		if ( outFasta )
+		{
+			sections |= SECTION_references;
+		}
+		
+		if ( outMfa || outMfaFiltered || outXmfa )
+		{
+			sections |= SECTION_references | SECTION_tracks | SECTION_lcbs | SECTION_variants;
+		}
+		
+		if ( outNewick )
+		{
+			sections |= SECTION_tree | SECTION_tracks;
+		}
+		
+		if ( outSnp )
+		{
+			sections |= SECTION_tracks | SECTION_variants;
+		}
+		
+		if ( outBB )
+		{
+			sections |= SECTION_tracks | SECTION_lcbs;
+		}
+		
+		if ( outVcf )
+		{
+			sections |= SECTION_references | SECTION_annotations | SECTION_tracks | SECTION_variants;
+			
+			if ( lca )
+			{
+				sections |= SECTION_tree;
+			}
+		}
+		
 		if ( ! quiet ) cerr << "Loading " << input << "..." << endl;
-		hio.loadHarvest(input);
+		
+		if ( filterCounts && ! (sections & SECTION_variants) && ! region )
+		{
+			// summed from the counts stored in the file if it has them
+			
+			filterCountsStored = hio.loadFilterCounts(input, filterCountsLoaded);
+		}
+		
+		if ( filterCounts && ! filterCountsStored )
+		{
+			sections |= SECTION_variants;
+		}
+		
+		if ( region && (sections & SECTION_variants) )
+		{
+			// variants are loaded separately, only for chunks overlapping
+			// the region; references are needed to resolve its name
+			
+			hio.loadHarvest(input, (sections & ~SECTION_variants) | SECTION_references);
+			
+			int sequence;
+			int start;
+			int end;
+			
+			try
+			{
+				parseRegion(region, hio.referenceList, sequence, start, end);
+			}
+			catch ( const ReferenceList::NameNotFoundException & e )
+			{
+				cerr << "ERROR: Sequence \"" << e.name << "\" not found in reference." << endl;
+				return 1;
+			}
+			
+			hio.loadVariantsInRange(input, sequence, start, end);
+		}
+		else
+		{
+			hio.loadHarvest(input, sections);
+		}
 	}
 	
 	if ( mfa )
@@ -308,6 +696,8 @@ int main(int argc, char * argv[])
 		}
 	}
 	
+	vector<VariantList::BedFilter> beds;
+	
 	for ( int i = 0; i < bed.size(); i++ )
 	{
 		char * arg = new char[strlen(bed[i]) + 1];
@@ -330,10 +720,40 @@ int main(int argc, char * argv[])
 			return 1;
 		}
 		
-		hio.loadBed(file, name, desc);
+		VariantList::BedFilter filter = {file, name, desc};
+		
+		beds.push_back(filter);
 		delete [] arg;
 	}
 	
+	if ( beds.size() )
+	{
+		hio.loadBeds(beds); // all at once, so variants are flagged in one pass
+	}
+	
+	if ( filterCounts )
+	{
+		for ( int i = 0; i < hio.variantList.getFilterCount(); i++ )
+		{
+			cout << hio.variantList.getFilter(i).name << '\t' << (filterCountsStored ? filterCountsLoaded[i] : hio.variantList.getFilterBitmap(i).getCount()) << endl;
+		}
+	}
+	
+	FilterExpression expression;
+	
+	if ( select )
+	{
+		try
+		{
+			expression.compile(select, hio.variantList);
+		}
+		catch ( const FilterExpression::ParseException & e )
+		{
+			cerr << "ERROR: " << e.message << " in filter expression (\"" << select << "\", position " << e.position + 1 << ")." << endl;
+			return 1;
+		}
+	}
+	
 	if ( midpointReroot )
 	{
 		hio.phylogenyTree.midpointReroot();
@@ -363,7 +783,7 @@ int main(int argc, char * argv[])
 	if ( output )
 	{
 		if (!quiet) cerr << "Writing " << output << "...\n";
-		hio.writeHarvest(output);
+		hio.writeHarvest(output, codec, codecLevel, packed);
 	}
 	
 	if ( outFasta )
@@ -395,7 +815,7 @@ int main(int argc, char * argv[])
 			fp = &fout;
 		}
 		
-		hio.writeMfa(*fp);
+		hio.writeMfa(*fp, select ? &expression : 0);
 	}
 
 	if ( outMfaFiltered )
@@ -416,7 +836,7 @@ int main(int argc, char * argv[])
 			fp2 = &fout2;
 		}
 		
-		hio.writeFilteredMfa(*fp, *fp2);
+		hio.writeFilteredMfa(*fp, *fp2, select ? &expression : 0);
 	}
 
 	if ( outNewick )
@@ -447,7 +867,7 @@ int main(int argc, char * argv[])
 			fp = &fout;
 		}
 		
-		hio.writeSnp(*fp, false);
+		hio.writeSnp(*fp, false, select ? &expression : 0);
 	}
 
 	if ( outBB )
@@ -479,7 +899,7 @@ int main(int argc, char * argv[])
 			fp = &fout;
 		}
 		
-		hio.writeXmfa(*fp);
+		hio.writeXmfa(*fp, false, select ? &expression : 0);
 	}
 
 	if ( outVcf )
@@ -513,7 +933,8 @@ int main(int argc, char * argv[])
 					hio.trackList.getTrackIndexByFile(tracks[1])
 				) : 0,
 				true,
-				signature
+				signature,
+				select ? &expression : 0
 			);
 		}
 		catch ( const TrackList::TrackNotFoundException & e )